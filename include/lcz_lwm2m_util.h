@@ -25,22 +25,166 @@ extern "C" {
 /**************************************************************************************************/
 /* Global Constants, Macros and Type Definitions                                                  */
 /**************************************************************************************************/
+enum lwm2m_deadband_mode {
+	/* Band is in the units of the resource */
+	LWM2M_DEADBAND_ABSOLUTE = 0,
+	/* Band is a percentage of the current value */
+	LWM2M_DEADBAND_PERCENT,
+};
+
+/* A new value is only written when it is outside the band around the current value */
+struct lwm2m_deadband {
+	uint16_t resource;
+	enum lwm2m_deadband_mode mode;
+	double band;
+};
+
+enum lwm2m_res_update_type {
+	LWM2M_RES_UPDATE_S32 = 0,
+	LWM2M_RES_UPDATE_U32,
+	LWM2M_RES_UPDATE_FLOAT,
+	LWM2M_RES_UPDATE_BOOL,
+	LWM2M_RES_UPDATE_OPAQUE,
+};
+
+/* New value for one resource of an object instance */
+struct lwm2m_res_update {
+	uint16_t resource;
+	enum lwm2m_res_update_type type;
+	union {
+		int32_t s32;
+		uint32_t u32;
+		double f;
+		bool b;
+		struct {
+			const void *data;
+			uint16_t len;
+		} opaque;
+	} value;
+};
+
+/* Recorded value of one resource (opaque isn't supported) */
+struct lwm2m_ts_sample {
+	/* Time of the sample provided by the application (for example, seconds since the epoch) */
+	int64_t timestamp;
+	/* Order in which the sample was recorded */
+	uint32_t seq;
+	uint16_t type;
+	uint16_t instance;
+	uint16_t resource;
+	/* enum lwm2m_res_update_type */
+	uint8_t value_type;
+	union {
+		int32_t s32;
+		uint32_t u32;
+		double f;
+		bool b;
+	} value;
+};
+
+/* Resource whose value is computed when it is read by the server.
+ * The value is copied into the data buffer of the resource, which must be large enough.
+ * Compute may be called from the engine thread and from threads that get the resource.
+ */
+struct lwm2m_lazy_res {
+	uint16_t resource;
+	/* Milliseconds that a computed value is used before it is computed again */
+	uint32_t ttl_ms;
+	/* Writes the value of the resource to buf.
+	 * Returns the length of the value, otherwise negative error code.
+	 * The previous value is used when it fails, so buf must only be written on success.
+	 */
+	int (*compute)(uint16_t type, uint16_t instance, uint16_t resource, void *buf,
+		       size_t buf_size, void *context);
+};
+
 struct lwm2m_obj_agent {
 	sys_snode_t node;
 	/* Object instanced type */
 	uint16_t type;
+	/* Optional last type of a range that starts with type (for example, IPSO 3300-3350) */
+	uint16_t type_last;
+	/* Optional set of types handled by the agent; type and type_last are ignored when set */
+	const uint16_t *types;
+	size_t type_count;
 	/* User data provided in callback */
 	void *context;
 	/* Callback that occurs after object instance is successfully created.
 	 * Index is -1 when callback managed objects aren't used.
+	 * When CONFIG_LCZ_LWM2M_UTIL_SHARDS is greater than 1, it may be called concurrently
+	 * for devices in different shards, so it must be reentrant.
 	 */
 	int (*create)(int idx, uint16_t type, uint16_t instance, void *context);
-	/* Callback that occurs when gateway object is deleted */
+	/* Optional callback that occurs once after a range of unmanaged object instances is
+	 * created.  When not set, create is called for each instance in the range.
+	 */
+	int (*create_range)(uint16_t type, uint16_t first_instance, uint16_t count, void *context);
+	/* Callback that occurs when gateway object is deleted.
+	 * It is called before returning from the gateway delete.  The managed instances of
+	 * the device are deleted afterwards by a work item.
+	 */
 #if defined(CONFIG_LCZ_LWM2M_UTIL_MANAGE_OBJ_INST)
 	int (*gw_obj_deleted)(int idx, void *context);
 #endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_DELETE_HOOK)
+	/* Set when the object registers its own engine delete callback, which then calls
+	 * lcz_lwm2m_util_obj_deleted.  The agent must be registered before the first instance
+	 * of the type is created.
+	 */
+	bool own_delete_cb;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_USER_DATA)
+	/* Size of zeroed user data allocated for each managed instance of this type */
+	size_t user_data_size;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_CAPACITY)
+	/* Optional number of instances the engine can hold for this type (0 when unknown) */
+	uint16_t max_instances;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_QUOTA)
+	/* Optional limit on the managed instances of this type (0 when unlimited) */
+	uint16_t quota;
+	/* Priority class; instances of lower classes are refused or evicted first */
+	uint8_t priority;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_OBSERVE_DEFAULTS)
+	/* Optional notification periods (seconds) set on each instance after it is created.
+	 * The engine only has an API for periods; use a deadband for step.
+	 */
+	uint32_t pmin;
+	uint32_t pmax;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES)
+	/* Number of samples buffered for this type (0 when not recorded) */
+	uint16_t ts_depth;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_LAZY_READ)
+	/* Optional table of resources computed on read; read callbacks are registered
+	 * for every instance that is created by the util.
+	 */
+	const struct lwm2m_lazy_res *lazy;
+	size_t lazy_count;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_DEADBAND)
+	/* Optional table of deadbands used by the filtered setters for this type */
+	const struct lwm2m_deadband *deadband;
+	size_t deadband_count;
+#endif
 };
 
+/* Post-write handler that is provided with the context and gateway index given at registration.
+ * Index is -1 for unmanaged object instances.
+ */
+typedef int (*lcz_lwm2m_util_post_write_handler_t)(int idx, uint16_t type, uint16_t instance,
+						   uint16_t resource, uint16_t resource_inst,
+						   uint8_t *data, uint16_t data_len,
+						   bool last_block, size_t total_size,
+						   void *context);
+
+/* Called with the user data of a managed instance while it can't be freed */
+typedef void (*lcz_lwm2m_util_user_data_cb_t)(uint16_t type, uint16_t instance, void *user_data,
+					      void *context);
+
 #define LCZ_LWM2M_UTIL_USER_INIT_PRIORITY 95
 BUILD_ASSERT(LCZ_LWM2M_UTIL_USER_INIT_PRIORITY > CONFIG_APPLICATION_INIT_PRIORITY,
 	     "LwM2M utilities must initialize before users");
@@ -51,22 +195,45 @@ BUILD_ASSERT(LCZ_LWM2M_UTIL_USER_INIT_PRIORITY > CONFIG_APPLICATION_INIT_PRIORIT
 
 /**
  * @brief Register creation and deletion callbacks
+ * An agent handles a single type, a range of types, or a set of types.
+ * If a type is already handled by another agent, then the first agent is used.
  *
  * @param agent is a linked list node of callbacks
+ * @return int 0 on success, -ENOMEM if there isn't room for the agent or its types
+ * (CONFIG_LCZ_LWM2M_UTIL_MAX_AGENTS and CONFIG_LCZ_LWM2M_UTIL_MAX_AGENT_RANGES), or
+ * -EEXIST if all of its types are handled by registered agents.  The agent isn't
+ * registered on failure.
  */
-void lcz_lwm2m_util_register_agent(struct lwm2m_obj_agent *agent);
+int lcz_lwm2m_util_register_agent(struct lwm2m_obj_agent *agent);
+
+/**
+ * @brief Unregister creation and deletion callbacks.
+ * When this returns, callbacks are no longer running for the agent and it can be released.
+ * @note Must not be called from an agent callback.
+ *
+ * @param agent that was previously registered
+ * @return int -ENOENT if agent isn't registered, otherwise 0
+ */
+int lcz_lwm2m_util_unregister_agent(struct lwm2m_obj_agent *agent);
 
 /**
  * @brief Get instance id for object from gateway.
  * Application may need to call @ref lcz_lwm2m_gw_obj_create before this.
  * If object doesn't exist, then try to create it.
  * Object instances are deleted if gateway object is deleted.
+ * Calls for different devices may run concurrently (CONFIG_LCZ_LWM2M_UTIL_SHARDS > 1),
+ * so the agent callbacks must be reentrant.
  *
  * @param type LwM2M object instance type
  * @param idx index into gateway object table
  * @param offset of instance, when multiple instances of same sensor is present
  * For example, a BT610 may have 4 temperature sensors with offsets of 0, 1, 2, and 3.
  * @return int negative error code, otherwise instance number
+ * -ENOSPC is returned without using a node when the type is known to be at capacity.
+ * -EDQUOT is returned when the quota of the type or the instance budget is reached.
+ * -EAGAIN is returned while the instances of a previous device that used the index are
+ * being deleted, while a lower priority instance is evicted to make room, or
+ * when the create rate is limited (CONFIG_LCZ_LWM2M_UTIL_ADMISSION).
  */
 int lcz_lwm2m_util_manage_obj_instance(uint16_t type, int idx, uint16_t offset);
 
@@ -74,6 +241,8 @@ int lcz_lwm2m_util_manage_obj_instance(uint16_t type, int idx, uint16_t offset);
  * @brief Inform manager that the object doesn't exist.
  * @note Putting this burden on the [sensor] instance is the simplest method to
  * handle deletion of objects by the server.
+ * When CONFIG_LCZ_LWM2M_UTIL_DELETE_HOOK is enabled, the util is informed by the engine
+ * and calling this isn't required.
  *
  * @param status of LwM2M engine call (e.g., set)
  * @param type LwM2M object instance type
@@ -83,6 +252,197 @@ int lcz_lwm2m_util_manage_obj_instance(uint16_t type, int idx, uint16_t offset);
  */
 int lcz_lwm2m_util_manage_obj_deletion(int status, uint16_t type, int idx, uint16_t instance);
 
+/**
+ * @brief Add a resource to the send batch.
+ * The setters of the util add each resource that they write.  The batch is sent after
+ * CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_PERIOD_MS or when
+ * CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_THRESHOLD paths are dirty, with one LwM2M Send per
+ * CONFIG_LWM2M_COMPOSITE_PATH_LIST_SIZE paths.  Paths that fail permanently (for example,
+ * a deleted instance) are dropped; others are retried after the period.  Requires
+ * @ref lcz_lwm2m_util_set_client_ctx.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param resource ID
+ * @return int 0 on success, -ENOMEM if the batch is full
+ */
+int lcz_lwm2m_util_send_mark(uint16_t type, uint16_t instance, uint16_t resource);
+
+/**
+ * @brief Send the dirty resources of the batch now.
+ */
+void lcz_lwm2m_util_send_flush(void);
+
+/**
+ * @brief Record timestamped samples of an object instance while the server can't be reached.
+ * Samples are kept in a ring that holds the ts_depth of the agent.  When the ring is full,
+ * the oldest sample is moved to flash (CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES_FLASH) or dropped.
+ * The resources of the instance aren't written.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param timestamp of the samples.  Samples in flash are kept across a reset, so use a
+ * time that doesn't restart (such as seconds since the epoch).
+ * @param u list of resource values (opaque isn't supported)
+ * @param n number of entries in list
+ * @return int 0 on success, otherwise negative error code
+ */
+int lcz_lwm2m_util_ts_record(uint16_t type, uint16_t instance, int64_t timestamp,
+			     const struct lwm2m_res_update *u, size_t n);
+
+/**
+ * @brief Copy the oldest recorded samples without removing them.
+ * Samples are returned in the order they were recorded, whether they are in flash or RAM.
+ * They aren't drained with LwM2M Send operations when the server can be reached again.
+ * The application reports the samples with their timestamps (for example, in a SenML
+ * payload) and then calls @ref lcz_lwm2m_util_ts_consume with the seq of the last one.
+ *
+ * @param samples output buffer
+ * @param max number of samples that fit in the buffer
+ * @return int number of samples copied, otherwise negative error code
+ */
+int lcz_lwm2m_util_ts_peek(struct lwm2m_ts_sample *samples, size_t max);
+
+/**
+ * @brief Remove the recorded samples up to a sample returned by @ref lcz_lwm2m_util_ts_peek.
+ * Samples recorded after the peek are kept.  Samples consumed from flash are returned again
+ * after a reset until the file is empty.
+ *
+ * @param seq of the last sample that was reported
+ */
+void lcz_lwm2m_util_ts_consume(uint32_t seq);
+
+/**
+ * @brief Set a signed integer resource if the value differs from the current value.
+ * Writing the same value is skipped so that notify and observe processing doesn't occur.
+ * When the object instance doesn't exist and it is managed, then
+ * @ref lcz_lwm2m_util_manage_obj_deletion is called.
+ *
+ * @param idx index into gateway object table (-1 when unmanaged)
+ * @param type ID of object
+ * @param instance ID
+ * @param resource ID
+ * @param value to set
+ * @return int negative error code, 0 if unchanged, 1 if value was written
+ */
+int lcz_lwm2m_util_set_s32_if_changed(int idx, uint16_t type, uint16_t instance,
+				      uint16_t resource, int32_t value);
+
+/**
+ * @brief Set an unsigned integer resource if the value differs from the current value.
+ * @ref lcz_lwm2m_util_set_s32_if_changed
+ */
+int lcz_lwm2m_util_set_u32_if_changed(int idx, uint16_t type, uint16_t instance,
+				      uint16_t resource, uint32_t value);
+
+/**
+ * @brief Set a float resource if the value differs from the current value.
+ * @ref lcz_lwm2m_util_set_s32_if_changed
+ */
+int lcz_lwm2m_util_set_float_if_changed(int idx, uint16_t type, uint16_t instance,
+					uint16_t resource, double value);
+
+/**
+ * @brief Set a boolean resource if the value differs from the current value.
+ * @ref lcz_lwm2m_util_set_s32_if_changed
+ */
+int lcz_lwm2m_util_set_bool_if_changed(int idx, uint16_t type, uint16_t instance,
+				       uint16_t resource, bool value);
+
+/**
+ * @brief Set an opaque resource if the length or contents differ from the current value.
+ * @ref lcz_lwm2m_util_set_s32_if_changed
+ */
+int lcz_lwm2m_util_set_opaque_if_changed(int idx, uint16_t type, uint16_t instance,
+					 uint16_t resource, const void *data, uint16_t data_len);
+
+/**
+ * @brief Set multiple resources of one object instance.
+ * The object instance portion of the path is generated once and
+ * values that are unchanged are skipped.  Processing stops at the first error.
+ *
+ * @param idx index into gateway object table (-1 when unmanaged)
+ * @param type ID of object
+ * @param instance ID
+ * @param u list of resource updates
+ * @param n number of updates in list
+ * @return int negative error code, otherwise number of values written
+ */
+int lcz_lwm2m_util_set_batch(int idx, uint16_t type, uint16_t instance,
+			     const struct lwm2m_res_update *u, size_t n);
+
+/**
+ * @brief Set a signed integer resource if the value is outside of the deadband registered
+ * for the object type and resource by its agent.
+ * Without a deadband this behaves like @ref lcz_lwm2m_util_set_s32_if_changed.
+ *
+ * @param idx index into gateway object table (-1 when unmanaged)
+ * @param type ID of object
+ * @param instance ID
+ * @param resource ID
+ * @param value to set
+ * @return int negative error code, 0 if filtered, 1 if value was written
+ */
+int lcz_lwm2m_util_set_s32_filtered(int idx, uint16_t type, uint16_t instance, uint16_t resource,
+				    int32_t value);
+
+/**
+ * @brief Set a float resource if the value is outside of the deadband registered
+ * for the object type and resource by its agent.
+ * @ref lcz_lwm2m_util_set_s32_filtered
+ */
+int lcz_lwm2m_util_set_float_filtered(int idx, uint16_t type, uint16_t instance,
+				      uint16_t resource, double value);
+
+/**
+ * @brief Find the gateway index of a managed object instance.
+ * This is a constant time lookup that can be used from engine callbacks
+ * that only know the path.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param idx index into gateway object table (may be NULL)
+ * @return int -ENOENT if the instance isn't managed, otherwise 0
+ */
+int lcz_lwm2m_util_lookup(uint16_t type, uint16_t instance, int *idx);
+
+/**
+ * @brief Get the user data of a managed object instance.
+ * User data is allocated before the agent's create callback and it is freed
+ * when the instance is deleted.
+ * @note The instance can be deleted by another thread at any time (a delete by the server,
+ * an eviction, or a gateway delete), which frees the user data.  The pointer is only safe
+ * to use in the agent's create callback.  Use @ref lcz_lwm2m_util_use_user_data elsewhere.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @return void* user data, NULL if the instance isn't managed or the agent has no user data
+ */
+void *lcz_lwm2m_util_get_user_data(uint16_t type, uint16_t instance);
+
+/**
+ * @brief Call a function with the user data of a managed object instance.
+ * The user data isn't freed until the callback returns.  The callback runs with the
+ * device of the instance locked, so it must not block or delete object instances.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param cb called with the user data
+ * @param context passed to the callback
+ * @return int -ENOENT if the instance isn't managed or the agent has no user data,
+ * otherwise 0
+ */
+int lcz_lwm2m_util_use_user_data(uint16_t type, uint16_t instance,
+				 lcz_lwm2m_util_user_data_cb_t cb, void *context);
+
+/**
+ * @brief Set the client context used for engine calls that require it
+ * (default notification periods and send).
+ *
+ * @param client_ctx LwM2M client context
+ */
+void lcz_lwm2m_util_set_client_ctx(struct lwm2m_ctx *client_ctx);
+
 /**
  * @brief Create LwM2M object instance. Wraps engine call with path generation.
  * If object instance is created, then registered create callbacks will be issued.
@@ -93,6 +453,63 @@ int lcz_lwm2m_util_manage_obj_deletion(int status, uint16_t type, int idx, uint1
  */
 int lcz_lwm2m_util_create_obj_inst(uint16_t type, uint16_t instance);
 
+/**
+ * @brief Create a contiguous range of unmanaged LwM2M object instances.
+ * The agent is called once (create_range or create for each instance) and a single
+ * creation message is broadcast.  If the engine can't create an instance, then
+ * the instances already created by this call are deleted.
+ *
+ * @param type of object
+ * @param first_instance ID
+ * @param count number of instances
+ * @return int 0 on success, otherwise negative error code
+ */
+int lcz_lwm2m_util_create_obj_inst_range(uint16_t type, uint16_t first_instance, uint16_t count);
+
+/**
+ * @brief Check if an object instance created by the util exists.
+ * Managed instances and unmanaged instances created with @ref lcz_lwm2m_util_create_obj_inst
+ * are tracked.  Unmanaged instances are only tracked in a window of
+ * CONFIG_LCZ_LWM2M_UTIL_UNMANAGED_MAX_INSTANCES that starts at the first valid instance.
+ *
+ * @param type of object
+ * @param instance ID
+ * @return int -ERANGE if the instance can't be tracked, otherwise 1 if it exists and 0 if not
+ */
+int lcz_lwm2m_util_obj_inst_exists(uint16_t type, uint16_t instance);
+
+/**
+ * @brief Tell the util that the engine deleted an object instance.
+ * Only needed by objects whose agent sets own_delete_cb; the delete hook of the util
+ * does this for other types.  It doesn't block, so it can be called from the engine
+ * delete callback.
+ *
+ * @param type of object
+ * @param instance ID
+ */
+void lcz_lwm2m_util_obj_deleted(uint16_t type, uint16_t instance);
+
+/**
+ * @brief Get the unmanaged instances of a type that were created by the util.
+ *
+ * @param type of object
+ * @param instances list that is filled with instance IDs (may be NULL)
+ * @param max number of entries in list
+ * @return int number of unmanaged instances (may be larger than max)
+ */
+int lcz_lwm2m_util_get_unmanaged_instances(uint16_t type, uint16_t *instances, size_t max);
+
+/**
+ * @brief Get the number of instances of a type that can still be created.
+ * The capacity is the max_instances of the agent or the capacity learned when the
+ * engine last failed to allocate an instance, whichever is smaller.
+ * Creates fail with -ENOSPC when there isn't any headroom.
+ *
+ * @param type of object
+ * @return int -ENODATA if the capacity isn't known, otherwise the headroom
+ */
+int lcz_lwm2m_util_get_headroom(uint16_t type);
+
 /**
  * @brief Delete LwM2M object instance. Wraps engine call with path generation.
  *
@@ -102,6 +519,30 @@ int lcz_lwm2m_util_create_obj_inst(uint16_t type, uint16_t instance);
  */
 int lcz_lwm2m_util_delete_obj_instance(uint16_t type, uint16_t instance);
 
+/**
+ * @brief Delete a list of LwM2M object instances of one type.
+ * The object portion of the path is generated once.
+ * Instances that don't exist are skipped.  Processing stops at the first error.
+ *
+ * @param type of object
+ * @param instances list of instance IDs
+ * @param n number of instances in list
+ * @return int negative error code, otherwise number of instances deleted
+ */
+int lcz_lwm2m_util_delete_obj_instances(uint16_t type, const uint16_t *instances, size_t n);
+
+/**
+ * @brief Delete every managed object instance of a type.
+ * The nodes are reset, so an instance is created again the next time it is managed.
+ * The node of an instance that can't be deleted is kept.  Devices whose gateway object
+ * was deleted are skipped, because their instances are already being deleted.
+ *
+ * @param type of object
+ * @return int the first error if an instance couldn't be deleted, otherwise number of
+ * instances deleted
+ */
+int lcz_lwm2m_util_delete_managed_obj_instances(uint16_t type);
+
 /**
  * @brief Load configuration data for a resource.  The file name is the same
  * as the path (type.instance.resource). For example, "3435.62812.1" is for a filling
@@ -143,6 +584,36 @@ int lcz_lwm2m_util_save_config(uint16_t type, uint16_t instance, uint16_t resour
 int lcz_lwm2m_util_del_res_inst(uint16_t type, uint16_t instance, uint16_t resource,
 				uint16_t resource_inst);
 
+/**
+ * @brief Delete a contiguous range of resource instances.
+ * The resource path is generated once for the whole range.
+ * Resource instances that don't exist are skipped.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param resource ID
+ * @param first resource instance ID
+ * @param count number of resource instances
+ * @return int negative error code, otherwise number of resource instances deleted
+ */
+int lcz_lwm2m_util_del_res_insts(uint16_t type, uint16_t instance, uint16_t resource,
+				 uint16_t first, uint16_t count);
+
+/**
+ * @brief Delete the resource instances selected by a bitmap.
+ * Bit n of the mask (bit n % 32 of word n / 32) selects resource instance n.
+ * Resource instances that don't exist are skipped.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param resource ID
+ * @param mask of resource instances to delete
+ * @param num_bits number of valid bits in mask
+ * @return int negative error code, otherwise number of resource instances deleted
+ */
+int lcz_lwm2m_util_del_res_insts_mask(uint16_t type, uint16_t instance, uint16_t resource,
+				      const uint32_t *mask, size_t num_bits);
+
 /**
  * @brief Register for a callback after a write occurs to a specific resource instance.
  * Wraps engine call with path generation.
@@ -157,6 +628,64 @@ int lcz_lwm2m_util_del_res_inst(uint16_t type, uint16_t instance, uint16_t resou
 int lcz_lwm2m_util_reg_post_write_cb(uint16_t type, uint16_t instance, uint16_t resource,
 				     lwm2m_engine_set_data_cb_t cb);
 
+/**
+ * @brief Register the same post-write callback for a list of resources of one object instance.
+ * The object instance portion of the path is generated once.
+ * Registration stops at the first failure.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param resources list of resource IDs
+ * @param n number of resources in list
+ * @param cb callback
+ * @return int negative error code, 0 on success
+ */
+int lcz_lwm2m_util_reg_post_write_cbs(uint16_t type, uint16_t instance, const uint16_t *resources,
+				      size_t n, lwm2m_engine_set_data_cb_t cb);
+
+/**
+ * @brief Register a post-write callback for a resource of every instance of an object type.
+ * The callback is registered for managed instances that already exist and it is
+ * registered automatically for every instance that is created by the util.
+ * Type registrations can't be removed.
+ *
+ * @param type ID of object
+ * @param resource ID
+ * @param cb callback
+ * @return int negative error code, 0 on success
+ */
+int lcz_lwm2m_util_reg_type_post_write_cb(uint16_t type, uint16_t resource,
+					  lwm2m_engine_set_data_cb_t cb);
+
+/**
+ * @brief Register a post-write handler for a resource.
+ * The util registers its own engine callback for the resource and dispatches
+ * writes to the handler with the context and gateway index.
+ * A handler that is already registered for the resource is replaced.
+ * Handlers are unregistered when the object instance is deleted using
+ * @ref lcz_lwm2m_util_delete_obj_instance.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @param resource ID
+ * @param idx index into gateway object table (-1 when unmanaged)
+ * @param handler called after a write to the resource
+ * @param context user data provided to handler
+ * @return int negative error code, 0 on success
+ */
+int lcz_lwm2m_util_reg_post_write_handler(uint16_t type, uint16_t instance, uint16_t resource,
+					  int idx, lcz_lwm2m_util_post_write_handler_t handler,
+					  void *context);
+
+/**
+ * @brief Unregister all post-write handlers of an object instance.
+ *
+ * @param type ID of object
+ * @param instance ID
+ * @return int number of handlers removed
+ */
+int lcz_lwm2m_util_unreg_post_write_handlers(uint16_t type, uint16_t instance);
+
 #ifdef __cplusplus
 }
 #endif
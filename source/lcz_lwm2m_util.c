@@ -15,10 +15,14 @@ LOG_MODULE_REGISTER(lcz_lwm2m_util, CONFIG_LCZ_LWM2M_UTIL_LOG_LEVEL);
 #include <zephyr/init.h>
 #include <zephyr/net/lwm2m.h>
 
-#if defined(CONFIG_LCZ_LWM2M_UTIL_CONFIG_DATA)
+#if defined(CONFIG_LCZ_LWM2M_UTIL_CONFIG_DATA) || defined(CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES_FLASH)
 #include <file_system_utilities.h>
 #endif
 
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES_FLASH)
+#include <zephyr/fs/fs.h>
+#endif
+
 #if defined(CONFIG_LCZ_LWM2M_UTIL_MANAGE_OBJ_INST)
 #include <lcz_lwm2m_gateway_obj.h>
 #endif
@@ -41,25 +45,279 @@ LOG_MODULE_REGISTER(lcz_lwm2m_util, CONFIG_LCZ_LWM2M_UTIL_LOG_LEVEL);
 
 #define MANAGE_OBJS CONFIG_LCZ_LWM2M_UTIL_MANAGE_OBJ_INST
 
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE)
+#define MAX_TYPE_POST_WRITE CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE_MAX
+
+/* Entries are never removed.  They are published by incrementing the count. */
+struct type_post_write {
+	uint16_t type;
+	uint16_t resource;
+	lwm2m_engine_set_data_cb_t cb;
+};
+#endif
+
+#define POST_WRITE_DISPATCH IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_POST_WRITE_DISPATCH)
+#define DEADBAND IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_DEADBAND)
+#define DELETE_HOOK IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_DELETE_HOOK)
+#define USER_DATA IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_USER_DATA)
+#define TRACK_UNMANAGED IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_TRACK_UNMANAGED)
+#define CAPACITY IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_CAPACITY)
+#define QUOTA IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_QUOTA)
+#define ADMISSION IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_ADMISSION)
+#define OBSERVE_DEFAULTS IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_OBSERVE_DEFAULTS)
+#define SEND_BATCH IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH)
+#define TIME_SERIES IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES)
+#define TIME_SERIES_FLASH IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES_FLASH)
+#define LAZY_READ IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_LAZY_READ)
+
+#if LAZY_READ
+#define LAZY_CACHE_ENTRIES CONFIG_LCZ_LWM2M_UTIL_LAZY_READ_CACHE_ENTRIES
+
+struct lazy_cache_entry {
+	uint16_t type;
+	uint16_t instance;
+	uint16_t resource;
+	bool valid;
+	uint32_t expires;
+	size_t len;
+	uint8_t data[CONFIG_LCZ_LWM2M_UTIL_LAZY_READ_MAX_SIZE];
+};
+#endif
+
+#if TIME_SERIES
+#define TS_POOL_SAMPLES CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES_POOL_SAMPLES
+/* Samples are also the record format of the spill file */
+#define TS_FILE CONFIG_FSU_MOUNT_POINT "/lwm2m_ts.bin"
+
+/* Ring of the oldest to newest samples of a type that is allocated from the pool */
+struct ts_ring {
+	struct lwm2m_ts_sample *sample;
+	uint16_t depth;
+	uint16_t head;
+	uint16_t count;
+};
+#endif
+
+#if SEND_BATCH
+#define SEND_MAX_PATHS CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_MAX_PATHS
+/* The engine limits the number of paths in one Send */
+#define SEND_CHUNK_PATHS MIN(SEND_MAX_PATHS, CONFIG_LWM2M_COMPOSITE_PATH_LIST_SIZE)
+
+struct send_path {
+	uint16_t type;
+	uint16_t instance;
+	uint16_t resource;
+};
+
+struct send_batch {
+	struct k_spinlock lock;
+	struct k_work_delayable work;
+	size_t count;
+	struct send_path dirty[SEND_MAX_PATHS];
+	/* Only used by the work handler */
+	struct send_path pending[SEND_MAX_PATHS];
+	char paths[SEND_MAX_PATHS][LWM2M_MAX_PATH_STR_LEN];
+	const char *path_list[SEND_MAX_PATHS];
+};
+#endif
+
+#if QUOTA
+/* Managed instances allowed across all types (0 when unlimited) */
+#define INSTANCE_BUDGET CONFIG_LCZ_LWM2M_UTIL_INSTANCE_BUDGET
+#endif
+
+#if ADMISSION
+/* Tokens are kept in thousandths so that the rate can be applied each millisecond */
+#define TOKEN 1000
+#define ADMISSION_RATE CONFIG_LCZ_LWM2M_UTIL_ADMISSION_RATE
+#define ADMISSION_MAX_TOKENS (CONFIG_LCZ_LWM2M_UTIL_ADMISSION_BURST * TOKEN)
+
+struct admission {
+	struct k_spinlock lock;
+	uint32_t last_refill;
+	uint32_t tokens;
+	/* Tokens are held for the most important priority that was recently refused */
+	bool held;
+	uint8_t held_priority;
+	uint32_t held_until;
+};
+#endif
+
+/* Engine callbacks don't provide the object type.  Each object type that uses a
+ * util owned engine callback is assigned a slot that has its own trampolines.
+ * Slots also hold per-type state.
+ */
+#define TYPE_SLOTS                                                                                 \
+	(POST_WRITE_DISPATCH || DELETE_HOOK || TRACK_UNMANAGED || CAPACITY || TIME_SERIES ||        \
+	 LAZY_READ)
+
+#if TRACK_UNMANAGED
+#define MAX_UNMANAGED CONFIG_LCZ_LWM2M_UTIL_UNMANAGED_MAX_INSTANCES
+
+/* Unmanaged instances are tracked in a window that starts at the first valid instance */
+#if MANAGE_OBJS
+#define UNMANAGED_BASE CONFIG_LCZ_LWM2M_GATEWAY_OBJ_LEGACY_INST_OFFSET
+#else
+#define UNMANAGED_BASE 0
+#endif
+#endif
+
+#if TYPE_SLOTS
+#define MAX_TYPES CONFIG_LCZ_LWM2M_UTIL_MAX_TYPES
+
+/* Slots are never freed.  A slot is published by incrementing the number of types
+ * after its contents are written, so readers don't need a lock.
+ */
+enum type_slot_flags {
+	TYPE_SLOT_DELETE_HOOK = 0,
+	/* The object type has its own delete callback, so the hook isn't registered */
+	TYPE_SLOT_DELETE_HOOK_CONFLICT,
+	TYPE_SLOT_NUM_FLAGS
+};
+
+struct type_slot {
+	uint16_t type;
+	ATOMIC_DEFINE(flags, TYPE_SLOT_NUM_FLAGS);
+#if TRACK_UNMANAGED
+	/* Unmanaged instances created by the util */
+	ATOMIC_DEFINE(unmanaged, MAX_UNMANAGED);
+#endif
+#if CAPACITY
+	/* Managed and tracked unmanaged instances created by the util */
+	atomic_t live;
+	/* Capacity learned when the engine runs out of instances (0 when unknown) */
+	atomic_t learned;
+#endif
+#if QUOTA
+	/* Managed instances, which can be evicted */
+	atomic_t managed;
+#endif
+#if TIME_SERIES
+	struct ts_ring ts;
+#endif
+};
+#endif
+
+/* Agents are found by a binary search of non-overlapping type ranges sorted by first type */
+#define MAX_AGENT_RANGES CONFIG_LCZ_LWM2M_UTIL_MAX_AGENT_RANGES
+#define MAX_AGENTS CONFIG_LCZ_LWM2M_UTIL_MAX_AGENTS
+
+struct agent_range {
+	uint16_t first;
+	uint16_t last;
+	struct lwm2m_obj_agent *agent;
+};
+
+/* Callbacks are dispatched from an immutable agent table without a lock.
+ * A new table is built from the agent list and published when an agent is registered or
+ * unregistered.  The writer then waits for readers of the previous table to drain,
+ * so the previous table can be reused and an unregistered agent can be released.
+ */
+struct agent_table {
+	atomic_t readers;
+	size_t range_count;
+	struct agent_range range[MAX_AGENT_RANGES];
+	size_t agent_count;
+	struct lwm2m_obj_agent *agent[MAX_AGENTS];
+};
+
+#if POST_WRITE_DISPATCH
+#define MAX_POST_WRITE_HANDLERS CONFIG_LCZ_LWM2M_UTIL_POST_WRITE_HANDLERS
+
+struct post_write_entry {
+	bool in_use;
+	uint16_t type;
+	uint16_t instance;
+	uint16_t resource;
+	int idx;
+	lcz_lwm2m_util_post_write_handler_t handler;
+	void *context;
+};
+#endif
+
 #if MANAGE_OBJS
 /* The total number of object instances [sensors] per gateway object instance */
 #define MAX_NODES CONFIG_LCZ_LWM2M_UTIL_MAX_NODES
 
 #define MAX_INSTANCES CONFIG_LWM2M_GATEWAY_MAX_INSTANCES
 
-enum lwm2m_create_state { CREATE_ALLOW = 0, CREATE_OK = 1, CREATE_FAIL = 2 };
+/* Each gateway index is hashed to a shard. A shard lock protects the node lists of the
+ * devices that map to it, so devices in different shards can be managed concurrently
+ * while operations on a single device remain ordered.
+ * Shard locks are never nested and object instances are never deleted from the engine
+ * while a shard lock is held.  The engine delete callback doesn't lock shards; the nodes
+ * of instances deleted by the engine are reset by a work item.
+ */
+#define NUM_SHARDS CONFIG_LCZ_LWM2M_UTIL_SHARDS
+#define SHARD(idx) ((idx) % NUM_SHARDS)
+
+enum lwm2m_create_state {
+	CREATE_ALLOW = 0,
+	CREATE_OK = 1,
+	CREATE_FAIL = 2,
+	/* Instance was deleted by the server; don't create it again until holdoff expires */
+	CREATE_HOLDOFF = 3
+};
 
 /* Keep track of the creation state of each node */
 struct node {
 	enum lwm2m_create_state create_state;
 	uint16_t type;
 	uint16_t instance;
+#if DELETE_HOOK
+	uint32_t holdoff_until;
+#endif
+#if USER_DATA
+	void *user_data;
+#endif
+};
+
+/* Object instance that was detached from its node and is waiting to be deleted */
+struct detached_inst {
+	uint16_t type;
+	uint16_t instance;
 };
 
 /* For each base/gateway object instance, there can be multiple [sensor] nodes */
 struct node_list {
 	uint16_t base_instance;
 	struct node node[MAX_NODES];
+	uint8_t detached_count;
+	struct detached_inst detached[MAX_NODES];
+};
+
+/* Reverse index from (type, instance) to the gateway index and node slot.
+ * Open addressing with linear probing; the table is never more than half full.
+ */
+#define INDEX_SIZE ((MAX_INSTANCES * MAX_NODES * 2) + 1)
+#define INDEX_EMPTY -1
+
+struct index_entry {
+	uint16_t type;
+	uint16_t instance;
+	int16_t idx;
+	uint8_t slot;
+};
+#endif
+
+#if DELETE_HOOK
+#define DELETE_QUEUE_SIZE CONFIG_LCZ_LWM2M_UTIL_DELETE_QUEUE_SIZE
+
+/* Instance deleted by the engine that is waiting for the delete work */
+struct deleted_inst {
+	uint16_t type;
+	uint16_t instance;
+	/* Gateway index and node of a managed instance (-1 when unmanaged) */
+	int16_t idx;
+	uint8_t node;
+};
+
+struct delete_queue {
+	struct k_spinlock lock;
+	struct k_work work;
+	uint16_t head;
+	uint16_t count;
+	struct deleted_inst inst[DELETE_QUEUE_SIZE];
 };
 #endif
 
@@ -68,29 +326,273 @@ struct node_list {
  */
 struct lcz_lwm2m_util {
 	struct k_mutex mutex;
+	/* Writer lock of the agent list and tables (held while readers drain) */
+	struct k_mutex agent_mutex;
 	sys_slist_t obj_agents;
+	atomic_ptr_t active_agents;
+	struct agent_table agent_table[2];
+	atomic_ptr_t client_ctx;
 #if MANAGE_OBJS
+	struct k_mutex shard_mutex[NUM_SHARDS];
 	struct node_list node_list[MAX_INSTANCES];
+	struct k_spinlock index_lock;
+	struct index_entry index[INDEX_SIZE];
+	struct k_work_delayable sweep_work;
+	ATOMIC_DEFINE(sweep_pending, MAX_INSTANCES);
+#endif
+#if QUOTA
+	atomic_t managed;
+	struct k_work evict_work;
+	/* Most important priority waiting for an eviction */
+	atomic_t evict_priority;
+#endif
+#if ADMISSION
+	struct admission admission;
+#endif
+#if DELETE_HOOK
+	struct delete_queue deleted;
+#endif
+#if SEND_BATCH
+	struct send_batch send;
+#endif
+#if LAZY_READ
+	/* Reads of the engine and the server can occur in different threads */
+	struct k_mutex lazy_mutex;
+	struct lazy_cache_entry lazy_cache[LAZY_CACHE_ENTRIES];
+#endif
+#if TIME_SERIES
+	struct k_mutex ts_mutex;
+	size_t ts_pool_used;
+	struct lwm2m_ts_sample ts_pool[TS_POOL_SAMPLES];
+	/* Sequence number of the last sample recorded */
+	uint32_t ts_seq;
+	/* Samples up to this sequence number were consumed */
+	uint32_t ts_consumed;
+#if TIME_SERIES_FLASH
+	/* Number of samples in the spill file (-1 until the file is read) */
+	int ts_file_count;
+	/* Sequence number of the last sample recorded in the file */
+	uint32_t ts_file_last;
+#endif
+#endif
+#if TYPE_SLOTS
+	struct k_spinlock type_lock;
+	atomic_t num_types;
+	struct type_slot type_slot[MAX_TYPES];
+#endif
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE)
+	atomic_t num_type_post_write;
+	struct type_post_write type_post_write[MAX_TYPE_POST_WRITE];
+#endif
+#if POST_WRITE_DISPATCH
+	struct k_spinlock dispatch_lock;
+	struct post_write_entry post_write[MAX_POST_WRITE_HANDLERS];
 #endif
 };
 
 /**************************************************************************************************/
 /* Local Data Definitions                                                                         */
 /**************************************************************************************************/
-static struct lcz_lwm2m_util utl;
+static struct lcz_lwm2m_util utl = {
+	.active_agents = ATOMIC_PTR_INIT(&utl.agent_table[0]),
+};
+
+#if USER_DATA
+/* Agent state only exists for object instances that exist */
+K_HEAP_DEFINE(user_data_heap, CONFIG_LCZ_LWM2M_UTIL_USER_DATA_POOL_SIZE);
+#endif
 
 /**************************************************************************************************/
 /* Local Function Prototypes                                                                      */
 /**************************************************************************************************/
-static int create_obj_inst(int idx, uint16_t type, uint16_t instance);
+static int create_obj_inst(int idx, uint16_t type, uint16_t instance, bool *created);
+static int post_create(uint16_t type, uint16_t instance);
+static int creation_callback_range(uint16_t type, uint16_t first_instance, uint16_t count);
 static int creation_callback(int idx, uint16_t type, uint16_t instance);
+static void publish_agents(void);
+static int agent_range_position(const struct agent_table *table, uint16_t first,
+				uint16_t last);
+static size_t agent_ranges_free(const struct agent_table *table,
+				const struct lwm2m_obj_agent *agent);
+static void add_agent_range(struct agent_table *table, struct lwm2m_obj_agent *agent,
+			    uint16_t first, uint16_t last);
+static struct agent_table *agents_get(void);
+static void agents_put(struct agent_table *table);
+static struct lwm2m_obj_agent *find_agent(const struct agent_table *table, uint16_t type);
+static int del_res_inst_with_prefix(char *path, size_t path_size, int prefix_len,
+				    uint16_t resource_inst);
+static int delete_obj_inst_with_prefix(char *path, size_t path_size, int prefix_len,
+				       uint16_t type, uint16_t instance);
+
+#if TRACK_UNMANAGED
+static int unmanaged_bit(uint16_t type, uint16_t instance, bool allocate, int *slot);
+static bool unmanaged_test_and_set(int slot, int bit, uint16_t instance);
+static bool unmanaged_exact(int slot);
+static void unmanaged_deleted(uint16_t type, uint16_t instance);
+static int reserve_unmanaged_range(uint16_t type, uint16_t first_instance, uint16_t count);
+static void release_unmanaged_range(uint16_t type, uint16_t first_instance, uint16_t count);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE)
+static int apply_type_post_write(uint16_t type, uint16_t instance);
+#endif
+
+#if OBSERVE_DEFAULTS
+static void apply_observe_defaults(uint16_t type, uint16_t instance);
+#endif
+
+#if LAZY_READ
+static int apply_lazy_read(uint16_t type, uint16_t instance);
+static void *lazy_read_dispatch(int slot, uint16_t instance, uint16_t resource,
+				uint16_t resource_inst, size_t *data_len);
+static struct lazy_cache_entry *lazy_cache_find(uint16_t type, uint16_t instance,
+						uint16_t resource);
+static struct lazy_cache_entry *lazy_cache_claim(void);
+static void lazy_cache_invalidate(uint16_t type, uint16_t instance);
+#endif
+
+#if CAPACITY
+static int capacity_check(uint16_t type, uint16_t count);
+static void capacity_adjust(int slot, int delta);
+static void capacity_learn(uint16_t type, int extra);
+static void capacity_freed(uint16_t type);
+#endif
+
+#if QUOTA
+static int quota_check(uint16_t type);
+static uint8_t type_priority(const struct agent_table *agents, uint16_t type);
+static bool find_eviction_type(uint8_t priority, uint16_t *type);
+static bool evict_one(uint16_t type);
+static void evict_work_handler(struct k_work *work);
+#endif
+
+#if ADMISSION
+static int admission_check(uint16_t type);
+#endif
+
+static int update_s32(const char *path, int32_t value);
+static int update_u32(const char *path, uint32_t value);
+static int update_float(const char *path, double value);
+static int update_bool(const char *path, bool value);
+static int update_opaque(const char *path, const void *data, uint16_t data_len);
+static int set_status(int status, int idx, uint16_t type, uint16_t instance, uint16_t resource);
+
+#if SEND_BATCH
+static int send_add(uint16_t type, uint16_t instance, uint16_t resource);
+static void send_work_handler(struct k_work *work);
+#endif
+
+#if TIME_SERIES
+static struct ts_ring *ts_get_ring(uint16_t type);
+static void ts_drop_oldest(struct ts_ring *ring);
+static bool ts_before(uint32_t a, uint32_t b);
+static size_t ts_insert(struct lwm2m_ts_sample *samples, size_t n, size_t max,
+			const struct lwm2m_ts_sample *sample);
+static size_t ts_peek_rings(struct lwm2m_ts_sample *samples, size_t n, size_t max);
+static void ts_consume_rings(void);
+#if TIME_SERIES_FLASH
+static int ts_file_samples(void);
+static int ts_read_file(struct lwm2m_ts_sample *samples, size_t max);
+static void ts_consume_file(void);
+#endif
+#endif
+
+#if DEADBAND
+static bool within_deadband(uint16_t type, uint16_t resource, double current, double value);
+#endif
+
+#if TYPE_SLOTS
+static int find_type_slot(uint16_t type);
+static int get_type_slot(uint16_t type);
+#endif
+
+#if POST_WRITE_DISPATCH
+static int post_write_dispatch(int slot, uint16_t instance, uint16_t resource,
+			       uint16_t resource_inst, uint8_t *data, uint16_t data_len,
+			       bool last_block, size_t total_size);
+#endif
+
+#if DELETE_HOOK
+static int register_delete_hook(uint16_t type);
+static int obj_deleted_callback(int slot, uint16_t instance);
+static void obj_deleted(uint16_t type, uint16_t instance);
+static bool delete_queue_pop(struct deleted_inst *deleted);
+static void delete_work_handler(struct k_work *work);
+#endif
 
 #if MANAGE_OBJS
 static int gw_obj_deleted_handler(int idx);
+static inline void shard_lock(int idx);
+static inline void shard_unlock(int idx);
 static inline void reset_node(struct node *node);
 static void gateway_obj_deleted_callback(int idx, void *data_ptr);
+static void sweep_work_handler(struct k_work *work);
+static void delete_detached(const struct detached_inst *detached, int count);
+static bool sweep_budget_exhausted(uint32_t start, int processed);
 static struct node *find_node(struct node_list *node_list, uint16_t type, uint16_t offset);
 static struct node *find_unused_node(struct node_list *node_list);
+static void allow_create_on_delete(uint16_t type);
+#if USER_DATA
+static void free_user_data(struct node *node);
+#endif
+static int index_insert(uint16_t type, uint16_t instance, int idx, int slot);
+static void index_remove(uint16_t type, uint16_t instance);
+static bool index_find(uint16_t type, uint16_t instance, int *idx, int *slot);
+#if CAPACITY
+static void managed_adjust(int slot, int delta);
+#endif
+#endif
+
+#if POST_WRITE_DISPATCH
+#define POST_WRITE_TRAMPOLINE(n, ...)                                                              \
+	static int post_write_trampoline_##n(uint16_t obj_inst_id, uint16_t res_id,               \
+					     uint16_t res_inst_id, uint8_t *data,                   \
+					     uint16_t data_len, bool last_block, size_t total_size) \
+	{                                                                                          \
+		return post_write_dispatch(n, obj_inst_id, res_id, res_inst_id, data, data_len,   \
+					   last_block, total_size);                                \
+	}
+
+#define POST_WRITE_TRAMPOLINE_NAME(n, ...) post_write_trampoline_##n
+
+LISTIFY(MAX_TYPES, POST_WRITE_TRAMPOLINE, ())
+
+static const lwm2m_engine_set_data_cb_t post_write_trampolines[MAX_TYPES] = {
+	LISTIFY(MAX_TYPES, POST_WRITE_TRAMPOLINE_NAME, (, ))
+};
+#endif
+
+#if LAZY_READ
+#define READ_TRAMPOLINE(n, ...)                                                                    \
+	static void *read_trampoline_##n(uint16_t obj_inst_id, uint16_t res_id,                   \
+					 uint16_t res_inst_id, size_t *data_len)                    \
+	{                                                                                          \
+		return lazy_read_dispatch(n, obj_inst_id, res_id, res_inst_id, data_len);         \
+	}
+
+#define READ_TRAMPOLINE_NAME(n, ...) read_trampoline_##n
+
+LISTIFY(MAX_TYPES, READ_TRAMPOLINE, ())
+
+static const lwm2m_engine_get_data_cb_t read_trampolines[MAX_TYPES] = {
+	LISTIFY(MAX_TYPES, READ_TRAMPOLINE_NAME, (, ))
+};
+#endif
+
+#if DELETE_HOOK
+#define DELETE_TRAMPOLINE(n, ...)                                                                  \
+	static int delete_trampoline_##n(uint16_t obj_inst_id)                                     \
+	{                                                                                          \
+		return obj_deleted_callback(n, obj_inst_id);                                       \
+	}
+
+#define DELETE_TRAMPOLINE_NAME(n, ...) delete_trampoline_##n
+
+LISTIFY(MAX_TYPES, DELETE_TRAMPOLINE, ())
+
+static const lwm2m_engine_user_cb_t delete_trampolines[MAX_TYPES] = {
+	LISTIFY(MAX_TYPES, DELETE_TRAMPOLINE_NAME, (, ))
+};
 #endif
 
 /**************************************************************************************************/
@@ -99,11 +601,33 @@ static struct node *find_unused_node(struct node_list *node_list);
 static int lcz_lwm2m_util_init(const struct device *dev)
 {
 	ARG_UNUSED(dev);
+#if MANAGE_OBJS
+	int i;
+#endif
 
 	k_mutex_init(&utl.mutex);
+	k_mutex_init(&utl.agent_mutex);
 	sys_slist_init(&utl.obj_agents);
 
 #if MANAGE_OBJS
+	for (i = 0; i < NUM_SHARDS; i++) {
+		k_mutex_init(&utl.shard_mutex[i]);
+	}
+
+	for (i = 0; i < INDEX_SIZE; i++) {
+		utl.index[i].idx = INDEX_EMPTY;
+	}
+
+	k_work_init_delayable(&utl.sweep_work, sweep_work_handler);
+#if QUOTA
+	k_work_init(&utl.evict_work, evict_work_handler);
+#endif
+
+#if ADMISSION
+	utl.admission.tokens = ADMISSION_MAX_TOKENS;
+	utl.admission.last_refill = k_uptime_get_32();
+#endif
+
 	lcz_lwm2m_gw_obj_set_telem_delete_cb(gateway_obj_deleted_callback);
 #endif
 
@@ -111,6 +635,25 @@ static int lcz_lwm2m_util_init(const struct device *dev)
 	fsu_mkdir_abs(CFG_PATH, true);
 #endif
 
+#if DELETE_HOOK
+	k_work_init(&utl.deleted.work, delete_work_handler);
+#endif
+
+#if SEND_BATCH
+	k_work_init_delayable(&utl.send.work, send_work_handler);
+#endif
+
+#if LAZY_READ
+	k_mutex_init(&utl.lazy_mutex);
+#endif
+
+#if TIME_SERIES
+	k_mutex_init(&utl.ts_mutex);
+#if TIME_SERIES_FLASH
+	utl.ts_file_count = -1;
+#endif
+#endif
+
 	return 0;
 }
 
@@ -119,11 +662,50 @@ SYS_INIT(lcz_lwm2m_util_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
 /**************************************************************************************************/
 /* Global Function Definitions                                                                    */
 /**************************************************************************************************/
-void lcz_lwm2m_util_register_agent(struct lwm2m_obj_agent *agent)
+int lcz_lwm2m_util_register_agent(struct lwm2m_obj_agent *agent)
 {
-	k_mutex_lock(&utl.mutex, K_FOREVER);
-	sys_slist_append(&utl.obj_agents, &agent->node);
-	k_mutex_unlock(&utl.mutex);
+	struct agent_table *table;
+	size_t ranges;
+	int r = 0;
+
+	k_mutex_lock(&utl.agent_mutex, K_FOREVER);
+	/* The active table only changes with the agent mutex locked */
+	table = atomic_ptr_get(&utl.active_agents);
+	ranges = agent_ranges_free(table, agent);
+	if (table->agent_count >= MAX_AGENTS ||
+	    (table->range_count + ranges) > MAX_AGENT_RANGES) {
+		LOG_ERR("Not enough agent entries for %u", agent->type);
+		r = -ENOMEM;
+	} else if (ranges == 0) {
+		LOG_ERR("Agent types of %u are handled by registered agents", agent->type);
+		r = -EEXIST;
+	} else {
+		sys_slist_append(&utl.obj_agents, &agent->node);
+		publish_agents();
+	}
+	k_mutex_unlock(&utl.agent_mutex);
+
+	return r;
+}
+
+void lcz_lwm2m_util_set_client_ctx(struct lwm2m_ctx *client_ctx)
+{
+	atomic_ptr_set(&utl.client_ctx, client_ctx);
+}
+
+int lcz_lwm2m_util_unregister_agent(struct lwm2m_obj_agent *agent)
+{
+	int r = 0;
+
+	k_mutex_lock(&utl.agent_mutex, K_FOREVER);
+	if (sys_slist_find_and_remove(&utl.obj_agents, &agent->node)) {
+		publish_agents();
+	} else {
+		r = -ENOENT;
+	}
+	k_mutex_unlock(&utl.agent_mutex);
+
+	return r;
 }
 
 #if MANAGE_OBJS
@@ -134,9 +716,24 @@ int lcz_lwm2m_util_manage_obj_instance(uint16_t type, int idx, uint16_t offset)
 	int instance;
 	struct node_list *node_list = NULL;
 	struct node *node = NULL;
+#if USER_DATA
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	size_t user_data_size;
+#endif
 
-	k_mutex_lock(&utl.mutex, K_FOREVER);
+	if (idx < 0 || idx >= MAX_INSTANCES) {
+		return -EINVAL;
+	}
+
+	shard_lock(idx);
 	do {
+		/* Instances of the previous device of this index haven't been deleted */
+		if (atomic_test_bit(utl.sweep_pending, idx)) {
+			r = -EAGAIN;
+			break;
+		}
+
 		r = lcz_lwm2m_gw_obj_get_instance(idx);
 		if (r < 0) {
 			break;
@@ -175,6 +772,13 @@ int lcz_lwm2m_util_manage_obj_instance(uint16_t type, int idx, uint16_t offset)
 				/* Creation can fail for other reasons, but not enough instances is most likely */
 				r = -ENOMEM;
 				break;
+#if DELETE_HOOK
+			} else if (node->create_state == CREATE_HOLDOFF) {
+				if ((int32_t)(k_uptime_get_32() - node->holdoff_until) < 0) {
+					r = -EAGAIN;
+					break;
+				}
+#endif
 			} else {
 				LOG_WRN("unexpected create state");
 			}
@@ -186,19 +790,78 @@ int lcz_lwm2m_util_manage_obj_instance(uint16_t type, int idx, uint16_t offset)
 			}
 		}
 
-		/* Try to create object instance */
+#if CAPACITY
+		/* Fail fast without consuming the node */
+		r = capacity_check(type, 1);
+		if (r < 0) {
+			break;
+		}
+#endif
+
+#if QUOTA
+		r = quota_check(type);
+		if (r < 0) {
+			break;
+		}
+#endif
+
+#if ADMISSION
+		r = admission_check(type);
+		if (r < 0) {
+			break;
+		}
+#endif
+
+#if USER_DATA
+		/* Allocate before creation so that user data is available in the create callback */
+		agents = agents_get();
+		agent = find_agent(agents, type);
+		user_data_size = (agent != NULL) ? agent->user_data_size : 0;
+		agents_put(agents);
+		if (user_data_size > 0 && node->user_data == NULL) {
+			node->user_data = k_heap_alloc(&user_data_heap, user_data_size, K_NO_WAIT);
+			if (node->user_data == NULL) {
+				LOG_ERR("Unable to allocate user data for %u", type);
+				r = -ENOMEM;
+				break;
+			}
+			memset(node->user_data, 0, user_data_size);
+		}
+#endif
+
+		/* Try to create object instance.
+		 * The node is indexed first so that it can be found from the create callback.
+		 * An existing entry belongs to a live node of another device.
+		 */
+		r = index_insert(type, instance, idx, node - node_list->node);
+		if (r < 0) {
+			LOG_ERR("%u/%u is managed by another device", type, instance);
+#if USER_DATA
+			free_user_data(node);
+#endif
+			break;
+		}
 		node->type = type;
 		node->instance = instance;
-		r = create_obj_inst(idx, type, instance);
+		r = create_obj_inst(idx, type, instance, NULL);
 		if (r == 0) {
 			node->create_state = CREATE_OK;
 			r = instance;
 		} else {
+			index_remove(type, instance);
+#if USER_DATA
+			free_user_data(node);
+#endif
 			node->create_state = CREATE_FAIL;
+#if CAPACITY
+			if (r == -ENOMEM) {
+				capacity_learn(type, 0);
+			}
+#endif
 		}
 
 	} while (0);
-	k_mutex_unlock(&utl.mutex);
+	shard_unlock(idx);
 
 	LOG_DBG("%d", r);
 	return r;
@@ -214,7 +877,11 @@ int lcz_lwm2m_util_manage_obj_deletion(int status, uint16_t type, int idx, uint1
 		return 0;
 	}
 
-	k_mutex_lock(&utl.mutex, K_FOREVER);
+	if (idx < 0 || idx >= MAX_INSTANCES) {
+		return -EINVAL;
+	}
+
+	shard_lock(idx);
 	do {
 		node_list = lcz_lwm2m_gw_obj_get_telem_data(idx);
 		if (node_list == NULL) {
@@ -232,39 +899,98 @@ int lcz_lwm2m_util_manage_obj_deletion(int status, uint16_t type, int idx, uint1
 			break;
 		}
 	} while (0);
-	k_mutex_unlock(&utl.mutex);
+	shard_unlock(idx);
 
 	return r;
 }
-#endif /* MANAGE_OBJS */
 
-#if defined(CONFIG_LCZ_LWM2M_UTIL_CONFIG_DATA)
-int lcz_lwm2m_util_load_config(uint16_t type, uint16_t instance, uint16_t resource,
-			       uint16_t data_len)
+int lcz_lwm2m_util_lookup(uint16_t type, uint16_t instance, int *idx)
 {
-	int r = -EPERM;
-	char path[LWM2M_MAX_PATH_STR_LEN];
-	char data[CONFIG_LCZ_LWM2M_UTIL_CONFIG_DATA_MAX_SIZE];
-	char fname[CFG_FILE_NAME_MAX_SIZE];
+	int i;
+	int slot;
 
-	if (data_len == 0) {
-		return -EINVAL;
+	if (!index_find(type, instance, &i, &slot)) {
+		return -ENOENT;
 	}
 
-	if (data_len > sizeof(data)) {
-		LOG_ERR("Unsupported size");
-		return -ENOMEM;
+	if (idx != NULL) {
+		*idx = i;
 	}
 
-	do {
-		/* Path is used as filename.  Instance IDs must be static for this to work properly. */
-		LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
-		LCZ_SNPRINTK(fname, CFG_PATH "%u.%u.%u", type, instance, resource);
-		r = (int)fsu_read_abs(fname, data, data_len);
-		if (r < 0) {
-			LOG_WRN("Unable to load %s: %d", fname, r);
-			return r;
-		}
+	return 0;
+}
+
+#if USER_DATA
+void *lcz_lwm2m_util_get_user_data(uint16_t type, uint16_t instance)
+{
+	int idx;
+	int slot;
+
+	if (!index_find(type, instance, &idx, &slot)) {
+		return NULL;
+	}
+
+	return utl.node_list[idx].node[slot].user_data;
+}
+
+int lcz_lwm2m_util_use_user_data(uint16_t type, uint16_t instance,
+				 lcz_lwm2m_util_user_data_cb_t cb, void *context)
+{
+	struct node *node;
+	int idx;
+	int slot;
+	int r = -ENOENT;
+
+	if (cb == NULL) {
+		return -EINVAL;
+	}
+
+	if (!index_find(type, instance, &idx, &slot)) {
+		return -ENOENT;
+	}
+
+	/* User data is only freed with the shard locked */
+	shard_lock(idx);
+	node = &utl.node_list[idx].node[slot];
+	if (node->type == type && node->instance == instance &&
+	    node->create_state == CREATE_OK && node->user_data != NULL) {
+		cb(type, instance, node->user_data, context);
+		r = 0;
+	}
+	shard_unlock(idx);
+
+	return r;
+}
+#endif
+#endif /* MANAGE_OBJS */
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_CONFIG_DATA)
+int lcz_lwm2m_util_load_config(uint16_t type, uint16_t instance, uint16_t resource,
+			       uint16_t data_len)
+{
+	int r = -EPERM;
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	char data[CONFIG_LCZ_LWM2M_UTIL_CONFIG_DATA_MAX_SIZE];
+	char fname[CFG_FILE_NAME_MAX_SIZE];
+
+	if (data_len == 0) {
+		return -EINVAL;
+	}
+
+	if (data_len > sizeof(data)) {
+		LOG_ERR("Unsupported size");
+		return -ENOMEM;
+	}
+
+	do {
+		/* Path is used as filename.  Instance IDs must be static for this to work properly. */
+		LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+		LCZ_SNPRINTK(fname, CFG_PATH "%u.%u.%u", type, instance, resource);
+		r = (int)fsu_read_abs(fname, data, data_len);
+		if (r < 0) {
+			LOG_WRN("Unable to load %s: %d", fname, r);
+			return r;
+		}
 
 		r = lwm2m_engine_set_opaque(path, data, data_len);
 		if (r < 0) {
@@ -306,89 +1032,2341 @@ int lcz_lwm2m_util_del_res_inst(uint16_t type, uint16_t instance, uint16_t resou
 
 	LCZ_SNPRINTK(path, "%u/%u/%u/%u", type, instance, resource, resource_inst);
 
-	return lwm2m_engine_delete_res_inst(path);
+	return lwm2m_engine_delete_res_inst(path);
+}
+
+int lcz_lwm2m_util_del_res_insts(uint16_t type, uint16_t instance, uint16_t resource,
+				 uint16_t first, uint16_t count)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int len;
+	uint32_t i;
+	int r;
+	int deleted = 0;
+
+	if ((uint32_t)first + count > UINT16_MAX + 1) {
+		return -EINVAL;
+	}
+
+	/* The resource portion of the path is only generated once */
+	len = snprintk(path, sizeof(path), "%u/%u/%u/", type, instance, resource);
+
+	for (i = first; i < (uint32_t)first + count; i++) {
+		r = del_res_inst_with_prefix(path, sizeof(path), len, i);
+		if (r < 0) {
+			return r;
+		}
+		deleted += r;
+	}
+
+	return deleted;
+}
+
+int lcz_lwm2m_util_del_res_insts_mask(uint16_t type, uint16_t instance, uint16_t resource,
+				      const uint32_t *mask, size_t num_bits)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int len;
+	size_t word;
+	uint32_t bits;
+	uint32_t i;
+	int r;
+	int deleted = 0;
+
+	if (mask == NULL || num_bits > UINT16_MAX + 1) {
+		return -EINVAL;
+	}
+
+	len = snprintk(path, sizeof(path), "%u/%u/%u/", type, instance, resource);
+
+	for (word = 0; word < DIV_ROUND_UP(num_bits, 32); word++) {
+		bits = mask[word];
+		while (bits != 0) {
+			i = (word * 32) + find_lsb_set(bits) - 1;
+			bits &= bits - 1;
+			if (i >= num_bits) {
+				break;
+			}
+
+			r = del_res_inst_with_prefix(path, sizeof(path), len, i);
+			if (r < 0) {
+				return r;
+			}
+			deleted += r;
+		}
+	}
+
+	return deleted;
+}
+
+int lcz_lwm2m_util_reg_post_write_cb(uint16_t type, uint16_t instance, uint16_t resource,
+				     lwm2m_engine_set_data_cb_t cb)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+
+	return lwm2m_engine_register_post_write_callback(path, cb);
+}
+
+int lcz_lwm2m_util_reg_post_write_cbs(uint16_t type, uint16_t instance, const uint16_t *resources,
+				      size_t n, lwm2m_engine_set_data_cb_t cb)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int len;
+	size_t i;
+	int r = 0;
+
+	if (resources == NULL && n > 0) {
+		return -EINVAL;
+	}
+
+	/* The object instance portion of the path is only generated once */
+	len = snprintk(path, sizeof(path), "%u/%u/", type, instance);
+
+	for (i = 0; i < n; i++) {
+		snprintk(path + len, sizeof(path) - len, "%u", resources[i]);
+		r = lwm2m_engine_register_post_write_callback(path, cb);
+		if (r < 0) {
+			LOG_ERR("Unable to register post write callback for %s: %d", path, r);
+			break;
+		}
+	}
+
+	return r;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE)
+int lcz_lwm2m_util_reg_type_post_write_cb(uint16_t type, uint16_t resource,
+					  lwm2m_engine_set_data_cb_t cb)
+{
+	int r = 0;
+	int n;
+#if MANAGE_OBJS
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	struct node *node;
+	int i;
+	int j;
+#endif
+
+	if (cb == NULL) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&utl.mutex, K_FOREVER);
+	n = (int)atomic_get(&utl.num_type_post_write);
+	if (n < MAX_TYPE_POST_WRITE) {
+		utl.type_post_write[n].type = type;
+		utl.type_post_write[n].resource = resource;
+		utl.type_post_write[n].cb = cb;
+		atomic_set(&utl.num_type_post_write, n + 1);
+	} else {
+		LOG_ERR("Not enough type post-write entries");
+		r = -ENOMEM;
+	}
+	k_mutex_unlock(&utl.mutex);
+
+#if MANAGE_OBJS
+	/* Future instances are handled during creation.  Apply to managed instances that
+	 * already exist.
+	 */
+	for (j = 0; j < MAX_INSTANCES && r == 0; j++) {
+		shard_lock(j);
+		for (i = 0; i < MAX_NODES; i++) {
+			node = &utl.node_list[j].node[i];
+			if (node->type == type && node->create_state == CREATE_OK) {
+				LCZ_SNPRINTK(path, "%u/%u/%u", type, node->instance, resource);
+				r = lwm2m_engine_register_post_write_callback(path, cb);
+				if (r < 0) {
+					LOG_ERR("Unable to register post write callback for %s: %d",
+						path, r);
+					break;
+				}
+			}
+		}
+		shard_unlock(j);
+	}
+#endif
+
+	return r;
+}
+#endif /* CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE */
+
+#if POST_WRITE_DISPATCH
+int lcz_lwm2m_util_reg_post_write_handler(uint16_t type, uint16_t instance, uint16_t resource,
+					  int idx, lcz_lwm2m_util_post_write_handler_t handler,
+					  void *context)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	struct post_write_entry *entry = NULL;
+	k_spinlock_key_t key;
+	int slot;
+	int i;
+	int r;
+
+	if (handler == NULL) {
+		return -EINVAL;
+	}
+
+	slot = get_type_slot(type);
+	if (slot < 0) {
+		return slot;
+	}
+
+	key = k_spin_lock(&utl.dispatch_lock);
+	for (i = 0; i < MAX_POST_WRITE_HANDLERS; i++) {
+		if (utl.post_write[i].in_use) {
+			if (utl.post_write[i].type == type && utl.post_write[i].instance == instance &&
+			    utl.post_write[i].resource == resource) {
+				/* Replace existing handler */
+				entry = &utl.post_write[i];
+				break;
+			}
+		} else if (entry == NULL) {
+			entry = &utl.post_write[i];
+		}
+	}
+	if (entry != NULL) {
+		entry->in_use = true;
+		entry->type = type;
+		entry->instance = instance;
+		entry->resource = resource;
+		entry->idx = idx;
+		entry->handler = handler;
+		entry->context = context;
+	}
+	k_spin_unlock(&utl.dispatch_lock, key);
+
+	if (entry == NULL) {
+		LOG_ERR("Not enough post-write handlers");
+		return -ENOMEM;
+	}
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+	r = lwm2m_engine_register_post_write_callback(path, post_write_trampolines[slot]);
+	if (r < 0) {
+		LOG_ERR("Unable to register post write callback for %s: %d", path, r);
+		key = k_spin_lock(&utl.dispatch_lock);
+		entry->in_use = false;
+		k_spin_unlock(&utl.dispatch_lock, key);
+	}
+
+	return r;
+}
+
+int lcz_lwm2m_util_unreg_post_write_handlers(uint16_t type, uint16_t instance)
+{
+	k_spinlock_key_t key;
+	int count = 0;
+	int i;
+
+	key = k_spin_lock(&utl.dispatch_lock);
+	for (i = 0; i < MAX_POST_WRITE_HANDLERS; i++) {
+		if (utl.post_write[i].in_use && utl.post_write[i].type == type &&
+		    utl.post_write[i].instance == instance) {
+			utl.post_write[i].in_use = false;
+			count += 1;
+		}
+	}
+	k_spin_unlock(&utl.dispatch_lock, key);
+
+	return count;
+}
+#endif /* POST_WRITE_DISPATCH */
+
+int lcz_lwm2m_util_set_s32_if_changed(int idx, uint16_t type, uint16_t instance,
+				      uint16_t resource, int32_t value)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+
+	return set_status(update_s32(path, value), idx, type, instance, resource);
+}
+
+int lcz_lwm2m_util_set_u32_if_changed(int idx, uint16_t type, uint16_t instance,
+				      uint16_t resource, uint32_t value)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+
+	return set_status(update_u32(path, value), idx, type, instance, resource);
+}
+
+int lcz_lwm2m_util_set_float_if_changed(int idx, uint16_t type, uint16_t instance,
+					uint16_t resource, double value)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+
+	return set_status(update_float(path, value), idx, type, instance, resource);
+}
+
+int lcz_lwm2m_util_set_bool_if_changed(int idx, uint16_t type, uint16_t instance,
+				       uint16_t resource, bool value)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+
+	return set_status(update_bool(path, value), idx, type, instance, resource);
+}
+
+int lcz_lwm2m_util_set_opaque_if_changed(int idx, uint16_t type, uint16_t instance,
+					 uint16_t resource, const void *data, uint16_t data_len)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+
+	return set_status(update_opaque(path, data, data_len), idx, type, instance, resource);
+}
+
+int lcz_lwm2m_util_set_batch(int idx, uint16_t type, uint16_t instance,
+			     const struct lwm2m_res_update *u, size_t n)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int written = 0;
+	int len;
+	size_t i;
+	int r;
+
+	if (u == NULL && n > 0) {
+		return -EINVAL;
+	}
+
+	/* The object instance portion of the path is only generated once */
+	len = snprintk(path, sizeof(path), "%u/%u/", type, instance);
+
+	for (i = 0; i < n; i++) {
+		snprintk(path + len, sizeof(path) - len, "%u", u[i].resource);
+		switch (u[i].type) {
+		case LWM2M_RES_UPDATE_S32:
+			r = update_s32(path, u[i].value.s32);
+			break;
+		case LWM2M_RES_UPDATE_U32:
+			r = update_u32(path, u[i].value.u32);
+			break;
+		case LWM2M_RES_UPDATE_FLOAT:
+			r = update_float(path, u[i].value.f);
+			break;
+		case LWM2M_RES_UPDATE_BOOL:
+			r = update_bool(path, u[i].value.b);
+			break;
+		case LWM2M_RES_UPDATE_OPAQUE:
+			r = update_opaque(path, u[i].value.opaque.data, u[i].value.opaque.len);
+			break;
+		default:
+			r = -EINVAL;
+			break;
+		}
+
+		if (r < 0) {
+			LOG_ERR("Unable to update %s: %d", path, r);
+			return set_status(r, idx, type, instance, u[i].resource);
+		}
+#if SEND_BATCH
+		if (r > 0) {
+			lcz_lwm2m_util_send_mark(type, instance, u[i].resource);
+		}
+#endif
+		written += r;
+	}
+
+	return written;
+}
+
+#if SEND_BATCH
+int lcz_lwm2m_util_send_mark(uint16_t type, uint16_t instance, uint16_t resource)
+{
+	int r;
+
+	r = send_add(type, instance, resource);
+	if (r < 0) {
+		LOG_WRN("Send batch full, %u/%u/%u dropped", type, instance, resource);
+		return r;
+	}
+
+	if (r >= CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_THRESHOLD) {
+		k_work_reschedule(&utl.send.work, K_NO_WAIT);
+	} else {
+		/* Doesn't restart the period when a flush is already scheduled */
+		k_work_schedule(&utl.send.work, K_MSEC(CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_PERIOD_MS));
+	}
+
+	return 0;
+}
+
+void lcz_lwm2m_util_send_flush(void)
+{
+	k_work_reschedule(&utl.send.work, K_NO_WAIT);
+}
+#endif
+
+#if TIME_SERIES
+int lcz_lwm2m_util_ts_record(uint16_t type, uint16_t instance, int64_t timestamp,
+			     const struct lwm2m_res_update *u, size_t n)
+{
+	struct ts_ring *ring;
+	struct lwm2m_ts_sample *sample;
+	size_t i;
+	int r = 0;
+
+	if (u == NULL && n > 0) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (u[i].type == LWM2M_RES_UPDATE_OPAQUE) {
+			return -ENOTSUP;
+		}
+	}
+
+	k_mutex_lock(&utl.ts_mutex, K_FOREVER);
+#if TIME_SERIES_FLASH
+	/* Sequence numbers continue after the ones in the file */
+	(void)ts_file_samples();
+#endif
+	do {
+		ring = ts_get_ring(type);
+		if (ring == NULL) {
+			r = -ENOMEM;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ring->count == ring->depth) {
+				ts_drop_oldest(ring);
+			}
+
+			sample = &ring->sample[(ring->head + ring->count) % ring->depth];
+			sample->timestamp = timestamp;
+			sample->seq = ++utl.ts_seq;
+			sample->type = type;
+			sample->instance = instance;
+			sample->resource = u[i].resource;
+			sample->value_type = u[i].type;
+			switch (u[i].type) {
+			case LWM2M_RES_UPDATE_S32:
+				sample->value.s32 = u[i].value.s32;
+				break;
+			case LWM2M_RES_UPDATE_U32:
+				sample->value.u32 = u[i].value.u32;
+				break;
+			case LWM2M_RES_UPDATE_FLOAT:
+				sample->value.f = u[i].value.f;
+				break;
+			default:
+				sample->value.b = u[i].value.b;
+				break;
+			}
+			ring->count += 1;
+		}
+	} while (0);
+	k_mutex_unlock(&utl.ts_mutex);
+
+	return r;
+}
+
+int lcz_lwm2m_util_ts_peek(struct lwm2m_ts_sample *samples, size_t max)
+{
+	int n = 0;
+
+	if (samples == NULL && max > 0) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&utl.ts_mutex, K_FOREVER);
+#if TIME_SERIES_FLASH
+	n = ts_read_file(samples, max);
+#endif
+	if (n >= 0) {
+		n = ts_peek_rings(samples, n, max);
+	}
+	k_mutex_unlock(&utl.ts_mutex);
+
+	return n;
+}
+
+void lcz_lwm2m_util_ts_consume(uint32_t seq)
+{
+	k_mutex_lock(&utl.ts_mutex, K_FOREVER);
+#if TIME_SERIES_FLASH
+	(void)ts_file_samples();
+#endif
+	/* Samples recorded after the peek have a later sequence number */
+	if (ts_before(utl.ts_consumed, seq) && !ts_before(utl.ts_seq, seq)) {
+		utl.ts_consumed = seq;
+		ts_consume_rings();
+#if TIME_SERIES_FLASH
+		ts_consume_file();
+#endif
+	}
+	k_mutex_unlock(&utl.ts_mutex);
+}
+#endif /* TIME_SERIES */
+
+#if DEADBAND
+int lcz_lwm2m_util_set_s32_filtered(int idx, uint16_t type, uint16_t instance, uint16_t resource,
+				    int32_t value)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int32_t current;
+	int r;
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+	r = lwm2m_engine_get_s32(path, &current);
+	if (r == 0) {
+		if (current == value || within_deadband(type, resource, current, value)) {
+			return 0;
+		}
+		r = lwm2m_engine_set_s32(path, value);
+		if (r == 0) {
+			r = 1;
+		}
+	}
+
+	return set_status(r, idx, type, instance, resource);
+}
+
+int lcz_lwm2m_util_set_float_filtered(int idx, uint16_t type, uint16_t instance,
+				      uint16_t resource, double value)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	double current;
+	int r;
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+	r = lwm2m_engine_get_float(path, &current);
+	if (r == 0) {
+		if (current == value || within_deadband(type, resource, current, value)) {
+			return 0;
+		}
+		r = lwm2m_engine_set_float(path, &value);
+		if (r == 0) {
+			r = 1;
+		}
+	}
+
+	return set_status(r, idx, type, instance, resource);
+}
+#endif /* DEADBAND */
+
+int lcz_lwm2m_util_create_obj_inst(uint16_t type, uint16_t instance)
+{
+	bool created;
+	int r;
+#if TRACK_UNMANAGED
+	int slot;
+	int bit;
+#endif
+
+#ifdef CONFIG_LCZ_LWM2M_UTIL_MANAGE_OBJ_INST
+	if (instance < CONFIG_LCZ_LWM2M_GATEWAY_OBJ_LEGACY_INST_OFFSET) {
+		return -EINVAL;
+	}
+#endif
+
+#if CAPACITY
+	r = capacity_check(type, 1);
+	if (r < 0) {
+		return r;
+	}
+#endif
+
+#if TRACK_UNMANAGED
+	/* Reserve the instance so that duplicates fail without an engine call */
+	bit = unmanaged_bit(type, instance, true, &slot);
+	if (bit >= 0 && unmanaged_test_and_set(slot, bit, instance)) {
+		return -EEXIST;
+	}
+#endif
+
+	/* Index not used when unmanaged */
+	r = create_obj_inst(-1, type, instance, &created);
+
+#if TRACK_UNMANAGED
+	/* The instance remains tracked when the engine has it (a later step failed) */
+	if (r < 0 && bit >= 0 && !created && r != -EEXIST) {
+		unmanaged_deleted(type, instance);
+	}
+#endif
+
+#if CAPACITY
+	if (r == -ENOMEM) {
+		capacity_learn(type, 0);
+	}
+#endif
+
+	return r;
+}
+
+int lcz_lwm2m_util_create_obj_inst_range(uint16_t type, uint16_t first_instance, uint16_t count)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	uint16_t created = 0;
+	uint16_t instance;
+	int len;
+	int r;
+
+	if (count == 0 || ((uint32_t)first_instance + count) > UINT16_MAX) {
+		return -EINVAL;
+	}
+
+#ifdef CONFIG_LCZ_LWM2M_UTIL_MANAGE_OBJ_INST
+	if (first_instance < CONFIG_LCZ_LWM2M_GATEWAY_OBJ_LEGACY_INST_OFFSET) {
+		return -EINVAL;
+	}
+#endif
+
+#if CAPACITY
+	r = capacity_check(type, count);
+	if (r < 0) {
+		return r;
+	}
+#endif
+
+#if TRACK_UNMANAGED
+	r = reserve_unmanaged_range(type, first_instance, count);
+	if (r < 0) {
+		return r;
+	}
+#endif
+
+	/* The object portion of the path is only generated once */
+	len = snprintk(path, sizeof(path), "%u/", type);
+
+	do {
+#if DELETE_HOOK
+		/* Without the hook, deletes by the server are still reported by set_status */
+		(void)register_delete_hook(type);
+#endif
+
+		for (created = 0; created < count; created++) {
+			instance = first_instance + created;
+			snprintk(path + len, sizeof(path) - len, "%u", instance);
+			r = lwm2m_engine_create_obj_inst(path);
+			if (r < 0) {
+				break;
+			}
+
+			r = post_create(type, instance);
+			if (r < 0) {
+				created += 1;
+				break;
+			}
+		}
+		if (r < 0) {
+			LOG_ERR("Unable to create %u/%u: %d", type, instance, r);
+			break;
+		}
+
+		/* Instances remain when the agent fails (same as a single create) */
+		r = creation_callback_range(type, first_instance, count);
+		if (r < 0) {
+			break;
+		}
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_FWK_BROADCAST_ON_CREATE)
+		FRAMEWORK_MSG_CREATE_AND_BROADCAST(FWK_ID_RESERVED, FMC_LWM2M_OBJ_CREATED);
+#endif
+
+		return 0;
+
+	} while (0);
+
+	/* Range is all or nothing when the engine fails */
+	if (created < count) {
+		for (instance = first_instance; instance < (first_instance + created); instance++) {
+			delete_obj_inst_with_prefix(path, sizeof(path), len, type, instance);
+		}
+#if TRACK_UNMANAGED
+		release_unmanaged_range(type, first_instance, count);
+#endif
+#if CAPACITY
+		/* The instances created before the failure were deleted by the rollback */
+		if (r == -ENOMEM) {
+			capacity_learn(type, created);
+		}
+#endif
+	}
+
+	return r;
+}
+
+#if TRACK_UNMANAGED
+int lcz_lwm2m_util_obj_inst_exists(uint16_t type, uint16_t instance)
+{
+	int slot;
+	int bit;
+
+#if MANAGE_OBJS
+	if (lcz_lwm2m_util_lookup(type, instance, NULL) == 0) {
+		return 1;
+	}
+#endif
+
+	bit = unmanaged_bit(type, instance, false, &slot);
+	if (bit == -ENOENT) {
+		/* The util hasn't created an instance of this type */
+		return 0;
+	} else if (bit < 0) {
+		return bit;
+	}
+
+	return atomic_test_bit(utl.type_slot[slot].unmanaged, bit) ? 1 : 0;
+}
+
+int lcz_lwm2m_util_get_unmanaged_instances(uint16_t type, uint16_t *instances, size_t max)
+{
+	int count = 0;
+	int slot;
+	int i;
+
+	slot = find_type_slot(type);
+	if (slot < 0) {
+		return 0;
+	}
+
+	for (i = 0; i < MAX_UNMANAGED; i++) {
+		if (atomic_test_bit(utl.type_slot[slot].unmanaged, i)) {
+			if (instances != NULL && (size_t)count < max) {
+				instances[count] = UNMANAGED_BASE + i;
+			}
+			count += 1;
+		}
+	}
+
+	return count;
+}
+#endif /* TRACK_UNMANAGED */
+
+#if DELETE_HOOK
+void lcz_lwm2m_util_obj_deleted(uint16_t type, uint16_t instance)
+{
+	/* Types without a slot haven't been created by the util */
+	if (find_type_slot(type) >= 0) {
+		obj_deleted(type, instance);
+	}
+}
+#endif
+
+#if CAPACITY
+int lcz_lwm2m_util_get_headroom(uint16_t type)
+{
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	int configured = 0;
+	int learned = 0;
+	int limit;
+	int live = 0;
+	int slot;
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL) {
+		configured = agent->max_instances;
+	}
+	agents_put(agents);
+
+	slot = find_type_slot(type);
+	if (slot >= 0) {
+		learned = atomic_get(&utl.type_slot[slot].learned);
+		live = atomic_get(&utl.type_slot[slot].live);
+	}
+
+	/* The smaller of the known limits is used */
+	if (configured == 0 || (learned > 0 && learned < configured)) {
+		limit = learned;
+	} else {
+		limit = configured;
+	}
+
+	if (limit == 0) {
+		return -ENODATA;
+	}
+
+	return (live < limit) ? (limit - live) : 0;
+}
+#endif
+
+int lcz_lwm2m_util_delete_obj_instance(uint16_t type, uint16_t instance)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+#if TRACK_UNMANAGED
+	int r;
+#endif
+
+#if POST_WRITE_DISPATCH
+	lcz_lwm2m_util_unreg_post_write_handlers(type, instance);
+#endif
+
+#if LAZY_READ
+	lazy_cache_invalidate(type, instance);
+#endif
+
+	LCZ_SNPRINTK(path, "%u/%u", type, instance);
+
+#if TRACK_UNMANAGED
+	r = lwm2m_engine_delete_obj_inst(path);
+	if (r == 0 || r == -ENOENT) {
+		unmanaged_deleted(type, instance);
+#if CAPACITY
+		capacity_freed(type);
+#endif
+	}
+
+	return r;
+#else
+	return lwm2m_engine_delete_obj_inst(path);
+#endif
+}
+
+int lcz_lwm2m_util_delete_obj_instances(uint16_t type, const uint16_t *instances, size_t n)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int deleted = 0;
+	int len;
+	size_t i;
+	int r;
+
+	if (instances == NULL && n > 0) {
+		return -EINVAL;
+	}
+
+	/* The object portion of the path is only generated once */
+	len = snprintk(path, sizeof(path), "%u/", type);
+
+	for (i = 0; i < n; i++) {
+		r = delete_obj_inst_with_prefix(path, sizeof(path), len, type, instances[i]);
+		if (r < 0) {
+			return r;
+		}
+		deleted += r;
+	}
+
+	return deleted;
+}
+
+#if MANAGE_OBJS
+int lcz_lwm2m_util_delete_managed_obj_instances(uint16_t type)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	uint16_t instances[MAX_NODES];
+	uint8_t slots[MAX_NODES];
+	int status[MAX_NODES];
+	struct node *node;
+	int deleted = 0;
+	int error = 0;
+	int count;
+	int len;
+	int i;
+	int j;
+
+	len = snprintk(path, sizeof(path), "%u/", type);
+
+	for (j = 0; j < MAX_INSTANCES; j++) {
+		count = 0;
+		shard_lock(j);
+		/* The sweep deletes the instances of a deleted gateway object */
+		if (atomic_test_bit(utl.sweep_pending, j)) {
+			shard_unlock(j);
+			continue;
+		}
+
+		for (i = 0; i < MAX_NODES; i++) {
+			node = &utl.node_list[j].node[i];
+			if (node->type != type || node->create_state == CREATE_ALLOW) {
+				continue;
+			}
+
+			if (node->create_state == CREATE_OK) {
+				instances[count] = node->instance;
+				slots[count++] = i;
+			} else {
+				reset_node(node);
+			}
+		}
+		shard_unlock(j);
+
+		/* Instances are deleted after the shard is unlocked */
+		for (i = 0; i < count; i++) {
+			status[i] = delete_obj_inst_with_prefix(path, sizeof(path), len, type,
+								instances[i]);
+		}
+
+		/* A node is kept when its instance couldn't be deleted */
+		shard_lock(j);
+		for (i = 0; i < count; i++) {
+			if (status[i] < 0) {
+				LOG_ERR("Unable to delete %u/%u: %d", type, instances[i], status[i]);
+				error = (error == 0) ? status[i] : error;
+				continue;
+			}
+
+			deleted += status[i];
+			node = &utl.node_list[j].node[slots[i]];
+			if (node->type == type && node->instance == instances[i] &&
+			    node->create_state == CREATE_OK) {
+				reset_node(node);
+			}
+		}
+		shard_unlock(j);
+	}
+
+	return (error < 0) ? error : deleted;
+}
+#endif
+
+/**************************************************************************************************/
+/* Local Function Definitions                                                                     */
+/**************************************************************************************************/
+/* Created is set when the engine created the instance, even if a later step failed */
+static int create_obj_inst(int idx, uint16_t type, uint16_t instance, bool *created)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int r;
+
+	if (created != NULL) {
+		*created = false;
+	}
+
+	do {
+#if DELETE_HOOK
+		/* Without the hook, deletes by the server are still reported by set_status */
+		(void)register_delete_hook(type);
+#endif
+
+		LCZ_SNPRINTK(path, "%u/%u", type, instance);
+		r = lwm2m_engine_create_obj_inst(path);
+		if (r < 0) {
+			break;
+		}
+
+		if (created != NULL) {
+			*created = true;
+		}
+
+		r = post_create(type, instance);
+		if (r < 0) {
+			break;
+		}
+
+		r = creation_callback(idx, type, instance);
+		if (r < 0) {
+			break;
+		}
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_FWK_BROADCAST_ON_CREATE)
+		FRAMEWORK_MSG_CREATE_AND_BROADCAST(FWK_ID_RESERVED, FMC_LWM2M_OBJ_CREATED);
+#endif
+
+	} while (0);
+
+	return r;
+}
+
+/* Per-type setup of an instance after the engine has created it */
+static int post_create(uint16_t type, uint16_t instance)
+{
+	int r = 0;
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE)
+	r = apply_type_post_write(type, instance);
+	if (r < 0) {
+		return r;
+	}
+#endif
+
+#if OBSERVE_DEFAULTS
+	apply_observe_defaults(type, instance);
+#endif
+
+#if LAZY_READ
+	r = apply_lazy_read(type, instance);
+#endif
+
+	return r;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_UTIL_TYPE_POST_WRITE)
+static int apply_type_post_write(uint16_t type, uint16_t instance)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	int n = (int)atomic_get(&utl.num_type_post_write);
+	int len;
+	int i;
+	int r;
+
+	len = snprintk(path, sizeof(path), "%u/%u/", type, instance);
+
+	for (i = 0; i < n; i++) {
+		if (utl.type_post_write[i].type != type) {
+			continue;
+		}
+
+		snprintk(path + len, sizeof(path) - len, "%u", utl.type_post_write[i].resource);
+		r = lwm2m_engine_register_post_write_callback(path, utl.type_post_write[i].cb);
+		if (r < 0) {
+			LOG_ERR("Unable to register post write callback for %s: %d", path, r);
+			return r;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* The update functions return 1 if the value was written and 0 if it was unchanged */
+static int update_s32(const char *path, int32_t value)
+{
+	int32_t current;
+	int r;
+
+	r = lwm2m_engine_get_s32(path, &current);
+	if (r == 0 && current != value) {
+		r = lwm2m_engine_set_s32(path, value);
+		return (r < 0) ? r : 1;
+	}
+
+	return r;
+}
+
+static int update_u32(const char *path, uint32_t value)
+{
+	uint32_t current;
+	int r;
+
+	r = lwm2m_engine_get_u32(path, &current);
+	if (r == 0 && current != value) {
+		r = lwm2m_engine_set_u32(path, value);
+		return (r < 0) ? r : 1;
+	}
+
+	return r;
+}
+
+static int update_float(const char *path, double value)
+{
+	double current;
+	int r;
+
+	r = lwm2m_engine_get_float(path, &current);
+	if (r == 0 && current != value) {
+		r = lwm2m_engine_set_float(path, &value);
+		return (r < 0) ? r : 1;
+	}
+
+	return r;
+}
+
+static int update_bool(const char *path, bool value)
+{
+	bool current;
+	int r;
+
+	r = lwm2m_engine_get_bool(path, &current);
+	if (r == 0 && current != value) {
+		r = lwm2m_engine_set_bool(path, value);
+		return (r < 0) ? r : 1;
+	}
+
+	return r;
+}
+
+static int update_opaque(const char *path, const void *data, uint16_t data_len)
+{
+	void *current = NULL;
+	uint16_t current_len = 0;
+	uint8_t flags;
+	int r;
+
+	if (data == NULL && data_len > 0) {
+		return -EINVAL;
+	}
+
+	/* Compare in place; the engine buffer isn't copied */
+	r = lwm2m_engine_get_res_data(path, &current, &current_len, &flags);
+	if (r < 0) {
+		return r;
+	}
+
+	if (current_len == data_len &&
+	    (data_len == 0 || (current != NULL && memcmp(current, data, data_len) == 0))) {
+		return 0;
+	}
+
+	r = lwm2m_engine_set_opaque(path, (char *)data, data_len);
+	return (r < 0) ? r : 1;
+}
+
+/* Status is 1 when the resource was written.  An instance that no longer exists is
+ * reported to the manager so that it can be created again.
+ */
+static int set_status(int status, int idx, uint16_t type, uint16_t instance, uint16_t resource)
+{
+	if (status >= 0) {
+#if SEND_BATCH
+		if (status > 0) {
+			lcz_lwm2m_util_send_mark(type, instance, resource);
+		}
+#else
+		ARG_UNUSED(resource);
+#endif
+		return status;
+	}
+
+#if MANAGE_OBJS
+	if (idx >= 0) {
+		(void)lcz_lwm2m_util_manage_obj_deletion(status, type, idx, instance);
+	}
+#else
+	ARG_UNUSED(idx);
+	ARG_UNUSED(type);
+	ARG_UNUSED(instance);
+#endif
+
+	return status;
+}
+
+#if SEND_BATCH
+/* Returns the number of dirty paths or -ENOMEM when the batch is full */
+static int send_add(uint16_t type, uint16_t instance, uint16_t resource)
+{
+	struct send_batch *sb = &utl.send;
+	k_spinlock_key_t key;
+	size_t i;
+	int r;
+
+	key = k_spin_lock(&sb->lock);
+	for (i = 0; i < sb->count; i++) {
+		if (sb->dirty[i].type == type && sb->dirty[i].instance == instance &&
+		    sb->dirty[i].resource == resource) {
+			break;
+		}
+	}
+
+	if (i < sb->count) {
+		r = sb->count;
+	} else if (sb->count < SEND_MAX_PATHS) {
+		sb->dirty[sb->count].type = type;
+		sb->dirty[sb->count].instance = instance;
+		sb->dirty[sb->count].resource = resource;
+		sb->count += 1;
+		r = sb->count;
+	} else {
+		r = -ENOMEM;
+	}
+	k_spin_unlock(&sb->lock, key);
+
+	return r;
+}
+
+/* Errors that won't go away by sending the same paths again */
+static bool send_error_is_permanent(int error)
+{
+	return (error == -E2BIG || error == -EINVAL || error == -ENOENT);
+}
+
+static void send_work_handler(struct k_work *work)
+{
+	struct send_batch *sb = &utl.send;
+	struct lwm2m_ctx *client_ctx = atomic_ptr_get(&utl.client_ctx);
+	k_spinlock_key_t key;
+	size_t count;
+	size_t start;
+	size_t n;
+	size_t i;
+	int r = 0;
+
+	ARG_UNUSED(work);
+
+	key = k_spin_lock(&sb->lock);
+	count = sb->count;
+	memcpy(sb->pending, sb->dirty, count * sizeof(sb->dirty[0]));
+	sb->count = 0;
+	k_spin_unlock(&sb->lock, key);
+
+	if (count == 0) {
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintk(sb->paths[i], sizeof(sb->paths[i]), "%u/%u/%u", sb->pending[i].type,
+			 sb->pending[i].instance, sb->pending[i].resource);
+		sb->path_list[i] = sb->paths[i];
+	}
+
+	for (start = 0; start < count; start += n) {
+		n = MIN(count - start, SEND_CHUNK_PATHS);
+		if (client_ctx == NULL) {
+			r = -EPERM;
+		} else {
+			r = lwm2m_engine_send(client_ctx, &sb->path_list[start], n,
+					      IS_ENABLED(CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_CONFIRM));
+		}
+
+		if (r >= 0) {
+			LOG_DBG("Sent %zu paths", n);
+		} else if (send_error_is_permanent(r)) {
+			/* A deleted instance or a bad path fails every time */
+			LOG_ERR("Dropped %zu paths starting at %s: %d", n, sb->path_list[start], r);
+		} else {
+			break;
+		}
+	}
+
+	if (start < count) {
+		/* The remaining paths are merged with the ones marked since the snapshot and
+		 * retried after a period (the threshold isn't used so that an offline client
+		 * doesn't spin).
+		 */
+		LOG_ERR("Unable to send %zu paths: %d", count - start, r);
+		for (i = start; i < count; i++) {
+			(void)send_add(sb->pending[i].type, sb->pending[i].instance,
+				       sb->pending[i].resource);
+		}
+		k_work_schedule(&sb->work, K_MSEC(CONFIG_LCZ_LWM2M_UTIL_SEND_BATCH_PERIOD_MS));
+	}
+}
+#endif /* SEND_BATCH */
+
+#if TIME_SERIES
+/* Rings are allocated from the pool the first time a type is recorded (assumes mutex locked) */
+static struct ts_ring *ts_get_ring(uint16_t type)
+{
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	struct ts_ring *ring;
+	uint16_t depth = 0;
+	int slot;
+
+	slot = get_type_slot(type);
+	if (slot < 0) {
+		return NULL;
+	}
+
+	ring = &utl.type_slot[slot].ts;
+	if (ring->sample != NULL) {
+		return ring;
+	}
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL) {
+		depth = agent->ts_depth;
+	}
+	agents_put(agents);
+
+	if (depth == 0 || depth > (TS_POOL_SAMPLES - utl.ts_pool_used)) {
+		LOG_ERR("Unable to allocate %u samples for %u", depth, type);
+		return NULL;
+	}
+
+	ring->sample = &utl.ts_pool[utl.ts_pool_used];
+	ring->depth = depth;
+	utl.ts_pool_used += depth;
+
+	return ring;
+}
+
+/* The oldest sample is moved to flash when spilling is enabled, otherwise it is lost */
+static void ts_drop_oldest(struct ts_ring *ring)
+{
+#if TIME_SERIES_FLASH
+	ssize_t r = -EPERM;
+
+	if (ts_file_samples() < CONFIG_LCZ_LWM2M_UTIL_TIME_SERIES_FLASH_MAX_SAMPLES &&
+	    fsu_lfs_mount() == 0) {
+		r = fsu_append_abs(TS_FILE, &ring->sample[ring->head],
+				   sizeof(struct lwm2m_ts_sample));
+	}
+
+	if (r == sizeof(struct lwm2m_ts_sample)) {
+		if (utl.ts_file_count == 0 ||
+		    ts_before(utl.ts_file_last, ring->sample[ring->head].seq)) {
+			utl.ts_file_last = ring->sample[ring->head].seq;
+		}
+		utl.ts_file_count += 1;
+	} else {
+		LOG_WRN("Sample dropped");
+	}
+#else
+	LOG_DBG("Sample dropped");
+#endif
+
+	ring->head = (ring->head + 1) % ring->depth;
+	ring->count -= 1;
+}
+
+/* Sequence numbers are compared so that they can wrap */
+static bool ts_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+/* Samples are kept in order of sequence number.  When the buffer is full, the last sample is
+ * dropped to make room for an earlier one.
+ */
+static size_t ts_insert(struct lwm2m_ts_sample *samples, size_t n, size_t max,
+			const struct lwm2m_ts_sample *sample)
+{
+	size_t i;
+
+	if (n == max) {
+		if (n == 0 || !ts_before(sample->seq, samples[n - 1].seq)) {
+			return n;
+		}
+		n -= 1;
+	}
+
+	for (i = n; i > 0 && ts_before(sample->seq, samples[i - 1].seq); i--) {
+		samples[i] = samples[i - 1];
+	}
+	samples[i] = *sample;
+
+	return n + 1;
+}
+
+/* Each ring is in order of sequence number (assumes mutex locked) */
+static size_t ts_peek_rings(struct lwm2m_ts_sample *samples, size_t n, size_t max)
+{
+	const struct lwm2m_ts_sample *sample;
+	struct ts_ring *ring;
+	int count = (int)atomic_get(&utl.num_types);
+	size_t j;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		ring = &utl.type_slot[i].ts;
+		for (j = 0; j < ring->count; j++) {
+			sample = &ring->sample[(ring->head + j) % ring->depth];
+			if (n == max && (n == 0 || !ts_before(sample->seq, samples[n - 1].seq))) {
+				break;
+			}
+			n = ts_insert(samples, n, max, sample);
+		}
+	}
+
+	return n;
+}
+
+/* (assumes mutex locked) */
+static void ts_consume_rings(void)
+{
+	struct ts_ring *ring;
+	int count = (int)atomic_get(&utl.num_types);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		ring = &utl.type_slot[i].ts;
+		while (ring->count > 0 &&
+		       !ts_before(utl.ts_consumed, ring->sample[ring->head].seq)) {
+			ring->head = (ring->head + 1) % ring->depth;
+			ring->count -= 1;
+		}
+	}
+}
+
+#if TIME_SERIES_FLASH
+/* The file system may not be mounted at init, so the file is read on first use.
+ * Samples in the file are from before the reset, so they haven't been consumed.
+ */
+static int ts_file_samples(void)
+{
+	struct lwm2m_ts_sample sample;
+	struct fs_file_t file;
+	int r = -EPERM;
+
+	if (utl.ts_file_count >= 0) {
+		return utl.ts_file_count;
+	}
+
+	utl.ts_file_count = 0;
+	fs_file_t_init(&file);
+	if (fsu_lfs_mount() == 0) {
+		r = fs_open(&file, TS_FILE, FS_O_READ);
+	}
+
+	if (r == 0) {
+		while (fs_read(&file, &sample, sizeof(sample)) == sizeof(sample)) {
+			if (utl.ts_file_count == 0 || ts_before(sample.seq, utl.ts_consumed + 1)) {
+				utl.ts_consumed = sample.seq - 1;
+			}
+			if (utl.ts_file_count == 0 || ts_before(utl.ts_file_last, sample.seq)) {
+				utl.ts_file_last = sample.seq;
+			}
+			utl.ts_file_count += 1;
+		}
+		fs_close(&file);
+	}
+
+	if (utl.ts_file_count > 0) {
+		utl.ts_seq = utl.ts_file_last;
+	}
+
+	return utl.ts_file_count;
+}
+
+/* Samples are moved to the file from each ring, so the file isn't in order of sequence number.
+ * Returns the number of the earliest unconsumed samples read from the file.
+ */
+static int ts_read_file(struct lwm2m_ts_sample *samples, size_t max)
+{
+	struct lwm2m_ts_sample sample;
+	struct fs_file_t file;
+	size_t n = 0;
+	int r;
+
+	if (ts_file_samples() == 0 || max == 0) {
+		return 0;
+	}
+
+	fs_file_t_init(&file);
+	r = fs_open(&file, TS_FILE, FS_O_READ);
+	if (r < 0) {
+		LOG_ERR("Unable to open %s: %d", TS_FILE, r);
+		return r;
+	}
+
+	while (fs_read(&file, &sample, sizeof(sample)) == sizeof(sample)) {
+		if (ts_before(utl.ts_consumed, sample.seq)) {
+			n = ts_insert(samples, n, max, &sample);
+		}
+	}
+	fs_close(&file);
+
+	return n;
+}
+
+/* The file is deleted once all of it is consumed.  Consumption isn't saved, so samples that
+ * were consumed are read again after a reset (assumes file samples were read).
+ */
+static void ts_consume_file(void)
+{
+	if (utl.ts_file_count > 0 && !ts_before(utl.ts_consumed, utl.ts_file_last)) {
+		fs_unlink(TS_FILE);
+		utl.ts_file_count = 0;
+	}
+}
+#endif /* TIME_SERIES_FLASH */
+#endif /* TIME_SERIES */
+
+#if DEADBAND
+/* The current value is the last value written, so drift accumulates until it leaves the band */
+static bool within_deadband(uint16_t type, uint16_t resource, double current, double value)
+{
+	struct agent_table *agents;
+	const struct lwm2m_obj_agent *agent;
+	const struct lwm2m_deadband *db = NULL;
+	double delta;
+	double band;
+	size_t i;
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL && agent->deadband != NULL) {
+		for (i = 0; i < agent->deadband_count; i++) {
+			if (agent->deadband[i].resource == resource) {
+				db = &agent->deadband[i];
+				break;
+			}
+		}
+	}
+
+	if (db == NULL) {
+		agents_put(agents);
+		return false;
+	}
+
+	delta = (value > current) ? (value - current) : (current - value);
+	if (db->mode == LWM2M_DEADBAND_PERCENT) {
+		band = ((current < 0) ? -current : current) * db->band / 100.0;
+	} else {
+		band = db->band;
+	}
+	agents_put(agents);
+
+	return delta < band;
+}
+#endif /* DEADBAND */
+
+/* Returns 1 if the resource instance was deleted and 0 if it didn't exist */
+static int del_res_inst_with_prefix(char *path, size_t path_size, int prefix_len,
+				    uint16_t resource_inst)
+{
+	int r;
+
+	snprintk(path + prefix_len, path_size - prefix_len, "%u", resource_inst);
+
+	r = lwm2m_engine_delete_res_inst(path);
+	if (r == -ENOENT) {
+		return 0;
+	} else if (r < 0) {
+		LOG_ERR("Unable to delete %s: %d", path, r);
+		return r;
+	}
+
+	return 1;
+}
+
+/* Returns 1 if the object instance was deleted and 0 if it didn't exist */
+static int delete_obj_inst_with_prefix(char *path, size_t path_size, int prefix_len,
+				       uint16_t type, uint16_t instance)
+{
+	int r;
+
+#if POST_WRITE_DISPATCH
+	lcz_lwm2m_util_unreg_post_write_handlers(type, instance);
+#endif
+
+#if LAZY_READ
+	lazy_cache_invalidate(type, instance);
+#endif
+
+	snprintk(path + prefix_len, path_size - prefix_len, "%u", instance);
+
+	r = lwm2m_engine_delete_obj_inst(path);
+#if TRACK_UNMANAGED
+	if (r == 0 || r == -ENOENT) {
+		unmanaged_deleted(type, instance);
+#if CAPACITY
+		capacity_freed(type);
+#endif
+	}
+#else
+	ARG_UNUSED(type);
+#endif
+	if (r == -ENOENT) {
+		return 0;
+	} else if (r < 0) {
+		LOG_ERR("Unable to delete %s: %d", path, r);
+		return r;
+	}
+
+	return 1;
+}
+
+/* The agent is only looked up once for the range */
+static int creation_callback_range(uint16_t type, uint16_t first_instance, uint16_t count)
+{
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	uint16_t i;
+	int r = 0;
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL && agent->create_range != NULL) {
+		r = agent->create_range(type, first_instance, count, agent->context);
+	} else if (agent != NULL && agent->create != NULL) {
+		for (i = 0; i < count && r >= 0; i++) {
+			r = agent->create(-1, type, first_instance + i, agent->context);
+		}
+	}
+	agents_put(agents);
+
+	return r;
+}
+
+static int creation_callback(int idx, uint16_t type, uint16_t instance)
+{
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	int r = 0;
+
+	/* Find the custom creation function for the object type */
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL && agent->create != NULL) {
+		r = agent->create(idx, type, instance, agent->context);
+	}
+	agents_put(agents);
+
+	return r;
+}
+
+/* Build and publish a new agent table (assumes agent mutex locked).
+ * The agent mutex is only used for this, so agent callbacks that pin the previous table
+ * can use other util functions.  Agents must not be registered or unregistered from agent
+ * callbacks.
+ */
+static void publish_agents(void)
+{
+	struct agent_table *prev = atomic_ptr_get(&utl.active_agents);
+	struct agent_table *next = (prev == &utl.agent_table[0]) ? &utl.agent_table[1] :
+								   &utl.agent_table[0];
+	struct lwm2m_obj_agent *agent;
+	sys_snode_t *node;
+	size_t i;
+
+	/* The next table was drained before the previous publish returned */
+	next->range_count = 0;
+	next->agent_count = 0;
+	SYS_SLIST_FOR_EACH_NODE (&utl.obj_agents, node) {
+		agent = CONTAINER_OF(node, struct lwm2m_obj_agent, node);
+		if (next->agent_count >= MAX_AGENTS) {
+			LOG_ERR("Not enough agent entries");
+			break;
+		}
+		next->agent[next->agent_count++] = agent;
+
+		if (agent->types != NULL) {
+			for (i = 0; i < agent->type_count; i++) {
+				add_agent_range(next, agent, agent->types[i], agent->types[i]);
+			}
+		} else {
+			add_agent_range(next, agent, agent->type, MAX(agent->type, agent->type_last));
+		}
+	}
+
+	atomic_ptr_set(&utl.active_agents, next);
+
+	/* Sleep so that readers with a lower priority can run */
+	while (atomic_get(&prev->readers) != 0) {
+		k_sleep(K_MSEC(1));
+	}
+}
+
+/* Returns the sorted position of the range or -EEXIST if it overlaps a registered agent */
+static int agent_range_position(const struct agent_table *table, uint16_t first,
+				uint16_t last)
+{
+	const struct agent_range *range = table->range;
+	size_t n = table->range_count;
+	size_t i;
+
+	for (i = 0; i < n && range[i].first < first; i++) {
+	}
+
+	if ((i > 0 && range[i - 1].last >= first) || (i < n && range[i].first <= last)) {
+		return -EEXIST;
+	}
+
+	return i;
+}
+
+/* Returns the number of ranges of the agent that don't overlap a registered agent */
+static size_t agent_ranges_free(const struct agent_table *table,
+				const struct lwm2m_obj_agent *agent)
+{
+	size_t count = 0;
+	size_t i;
+
+	if (agent->types == NULL) {
+		if (agent_range_position(table, agent->type,
+					 MAX(agent->type, agent->type_last)) >= 0) {
+			count = 1;
+		}
+		return count;
+	}
+
+	for (i = 0; i < agent->type_count; i++) {
+		if (agent_range_position(table, agent->types[i], agent->types[i]) >= 0) {
+			count += 1;
+		}
+	}
+
+	return count;
+}
+
+/* Insert range in sorted position */
+static void add_agent_range(struct agent_table *table, struct lwm2m_obj_agent *agent,
+			    uint16_t first, uint16_t last)
+{
+	struct agent_range *range = table->range;
+	size_t n = table->range_count;
+	int i;
+
+	/* The first agent registered for a type is used */
+	i = agent_range_position(table, first, last);
+	if (i < 0) {
+		LOG_WRN("Agent types %u-%u overlap a registered agent", first, last);
+		return;
+	}
+
+	/* Registration checks the space, so this is only reached if the list is modified */
+	if (n >= MAX_AGENT_RANGES) {
+		LOG_ERR("Not enough agent ranges");
+		return;
+	}
+
+	memmove(&range[i + 1], &range[i], (n - i) * sizeof(range[0]));
+	range[i].first = first;
+	range[i].last = last;
+	range[i].agent = agent;
+	table->range_count = n + 1;
+}
+
+/* Pin the active agent table */
+static struct agent_table *agents_get(void)
+{
+	struct agent_table *table;
+
+	while (true) {
+		table = atomic_ptr_get(&utl.active_agents);
+		atomic_inc(&table->readers);
+		/* If the table was replaced before it was pinned, then the writer may not wait for it */
+		if (table == atomic_ptr_get(&utl.active_agents)) {
+			return table;
+		}
+		atomic_dec(&table->readers);
+	}
+}
+
+static void agents_put(struct agent_table *table)
+{
+	atomic_dec(&table->readers);
+}
+
+static struct lwm2m_obj_agent *find_agent(const struct agent_table *table, uint16_t type)
+{
+	const struct agent_range *range = table->range;
+	size_t lo = 0;
+	size_t hi = table->range_count;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (type < range[mid].first) {
+			hi = mid;
+		} else if (type > range[mid].last) {
+			lo = mid + 1;
+		} else {
+			return range[mid].agent;
+		}
+	}
+
+	return NULL;
+}
+
+#if TYPE_SLOTS
+static int find_type_slot(uint16_t type)
+{
+	int n = (int)atomic_get(&utl.num_types);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (utl.type_slot[i].type == type) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int get_type_slot(uint16_t type)
+{
+	k_spinlock_key_t key;
+	int slot;
+
+	slot = find_type_slot(type);
+	if (slot >= 0) {
+		return slot;
+	}
+
+	key = k_spin_lock(&utl.type_lock);
+	/* Another thread may have assigned a slot after the lock-free search */
+	slot = find_type_slot(type);
+	if (slot < 0) {
+		slot = (int)atomic_get(&utl.num_types);
+		if (slot < MAX_TYPES) {
+			utl.type_slot[slot].type = type;
+			atomic_set(&utl.num_types, slot + 1);
+		} else {
+			slot = -ENOMEM;
+		}
+	}
+	k_spin_unlock(&utl.type_lock, key);
+
+	if (slot < 0) {
+		LOG_ERR("Not enough type slots for %u", type);
+	}
+
+	return slot;
+}
+#endif /* TYPE_SLOTS */
+
+#if POST_WRITE_DISPATCH
+static int post_write_dispatch(int slot, uint16_t instance, uint16_t resource,
+			       uint16_t resource_inst, uint8_t *data, uint16_t data_len,
+			       bool last_block, size_t total_size)
+{
+	lcz_lwm2m_util_post_write_handler_t handler = NULL;
+	uint16_t type = utl.type_slot[slot].type;
+	void *context = NULL;
+	int idx = -1;
+	k_spinlock_key_t key;
+	int i;
+
+	key = k_spin_lock(&utl.dispatch_lock);
+	for (i = 0; i < MAX_POST_WRITE_HANDLERS; i++) {
+		if (utl.post_write[i].in_use && utl.post_write[i].type == type &&
+		    utl.post_write[i].instance == instance &&
+		    utl.post_write[i].resource == resource) {
+			handler = utl.post_write[i].handler;
+			context = utl.post_write[i].context;
+			idx = utl.post_write[i].idx;
+			break;
+		}
+	}
+	k_spin_unlock(&utl.dispatch_lock, key);
+
+	if (handler == NULL) {
+		LOG_DBG("No post-write handler for %u/%u/%u", type, instance, resource);
+		return 0;
+	}
+
+	return handler(idx, type, instance, resource, resource_inst, data, data_len, last_block,
+		       total_size, context);
+}
+#endif /* POST_WRITE_DISPATCH */
+
+#if OBSERVE_DEFAULTS
+/* Attributes are advisory, so a failure doesn't fail the create */
+static void apply_observe_defaults(uint16_t type, uint16_t instance)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	struct lwm2m_ctx *client_ctx = atomic_ptr_get(&utl.client_ctx);
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	uint32_t pmin = 0;
+	uint32_t pmax = 0;
+	int r;
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL) {
+		pmin = agent->pmin;
+		pmax = agent->pmax;
+	}
+	agents_put(agents);
+
+	if (pmin == 0 && pmax == 0) {
+		return;
+	}
+
+	if (client_ctx == NULL) {
+		LOG_WRN("Client context not set");
+		return;
+	}
+
+	LCZ_SNPRINTK(path, "%u/%u", type, instance);
+	if (pmin > 0) {
+		r = lwm2m_engine_update_observer_min_period(client_ctx, path, pmin);
+		if (r < 0) {
+			LOG_ERR("Unable to set pmin of %s: %d", path, r);
+		}
+	}
+
+	if (pmax > 0) {
+		r = lwm2m_engine_update_observer_max_period(client_ctx, path, pmax);
+		if (r < 0) {
+			LOG_ERR("Unable to set pmax of %s: %d", path, r);
+		}
+	}
+}
+#endif
+
+#if LAZY_READ
+/* Read callbacks are registered for the lazy resources of the agent */
+static int apply_lazy_read(uint16_t type, uint16_t instance)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	int slot = -1;
+	int len;
+	size_t i;
+	int r = 0;
+
+	len = snprintk(path, sizeof(path), "%u/%u/", type, instance);
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	for (i = 0; agent != NULL && i < agent->lazy_count; i++) {
+		if (slot < 0) {
+			slot = get_type_slot(type);
+			if (slot < 0) {
+				r = slot;
+				break;
+			}
+		}
+
+		snprintk(path + len, sizeof(path) - len, "%u", agent->lazy[i].resource);
+		r = lwm2m_engine_register_read_callback(path, read_trampolines[slot]);
+		if (r < 0) {
+			LOG_ERR("Unable to register read callback for %s: %d", path, r);
+			break;
+		}
+	}
+	agents_put(agents);
+
+	return r;
+}
+
+/* Values are computed when the server reads them and cached for the TTL of the resource.
+ * If the computation fails, then the previous value is used.
+ * The value is copied into the data buffer of the resource under the lock, so the pointer
+ * that is returned to the engine isn't reused by a read of another resource.
+ */
+static void *lazy_read_dispatch(int slot, uint16_t instance, uint16_t resource,
+				uint16_t resource_inst, size_t *data_len)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	uint16_t type = utl.type_slot[slot].type;
+	const struct lwm2m_lazy_res *lazy = NULL;
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	struct lazy_cache_entry *entry;
+	uint8_t value[CONFIG_LCZ_LWM2M_UTIL_LAZY_READ_MAX_SIZE];
+	uint32_t now = k_uptime_get_32();
+	uint8_t flags;
+	uint16_t size;
+	uint16_t len;
+	void *data = NULL;
+	size_t i;
+	int r;
+
+	ARG_UNUSED(resource_inst);
+
+	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+	r = lwm2m_engine_get_res_buf(path, &data, &size, &len, &flags);
+	if (r < 0) {
+		*data_len = 0;
+		return NULL;
+	}
+
+	k_mutex_lock(&utl.lazy_mutex, K_FOREVER);
+	entry = lazy_cache_find(type, instance, resource);
+	if (entry == NULL || (int32_t)(now - entry->expires) >= 0) {
+		agents = agents_get();
+		agent = find_agent(agents, type);
+		for (i = 0; agent != NULL && i < agent->lazy_count; i++) {
+			if (agent->lazy[i].resource == resource) {
+				lazy = &agent->lazy[i];
+				break;
+			}
+		}
+
+		if (lazy != NULL) {
+			r = lazy->compute(type, instance, resource, value, sizeof(value),
+					  agent->context);
+			if (r >= 0) {
+				/* Another value is only replaced after this one is computed */
+				if (entry == NULL) {
+					entry = lazy_cache_claim();
+				}
+				memcpy(entry->data, value, r);
+				entry->type = type;
+				entry->instance = instance;
+				entry->resource = resource;
+				entry->valid = true;
+				entry->expires = now + lazy->ttl_ms;
+				entry->len = r;
+			} else {
+				LOG_ERR("Unable to compute %u/%u/%u: %d", type, instance, resource,
+					r);
+			}
+		}
+		agents_put(agents);
+	}
+
+	/* Until a value is computed, the data of the resource is used */
+	if (entry != NULL) {
+		if (entry->len <= size) {
+			memcpy(data, entry->data, entry->len);
+			len = entry->len;
+		} else {
+			LOG_ERR("Computed %u/%u/%u doesn't fit", type, instance, resource);
+		}
+	}
+	k_mutex_unlock(&utl.lazy_mutex);
+
+	*data_len = len;
+	return data;
+}
+
+/* Returns the valid entry of the resource or NULL (assumes mutex locked) */
+static struct lazy_cache_entry *lazy_cache_find(uint16_t type, uint16_t instance,
+						uint16_t resource)
+{
+	struct lazy_cache_entry *entry;
+	int i;
+
+	for (i = 0; i < LAZY_CACHE_ENTRIES; i++) {
+		entry = &utl.lazy_cache[i];
+		if (entry->valid && entry->type == type && entry->instance == instance &&
+		    entry->resource == resource) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns an unused entry or the entry that expires first (assumes mutex locked) */
+static struct lazy_cache_entry *lazy_cache_claim(void)
+{
+	struct lazy_cache_entry *entry;
+	struct lazy_cache_entry *replace = &utl.lazy_cache[0];
+	int i;
+
+	for (i = 0; i < LAZY_CACHE_ENTRIES; i++) {
+		entry = &utl.lazy_cache[i];
+		if (!entry->valid) {
+			return entry;
+		} else if ((int32_t)(entry->expires - replace->expires) < 0) {
+			replace = entry;
+		}
+	}
+
+	return replace;
+}
+
+/* A new instance with the same ID doesn't use the values of the deleted one */
+static void lazy_cache_invalidate(uint16_t type, uint16_t instance)
+{
+	int i;
+
+	k_mutex_lock(&utl.lazy_mutex, K_FOREVER);
+	for (i = 0; i < LAZY_CACHE_ENTRIES; i++) {
+		if (utl.lazy_cache[i].type == type && utl.lazy_cache[i].instance == instance) {
+			utl.lazy_cache[i].valid = false;
+		}
+	}
+	k_mutex_unlock(&utl.lazy_mutex);
+}
+#endif /* LAZY_READ */
+
+#if TRACK_UNMANAGED
+/* Returns bit in the unmanaged bitmap of the type slot, -ERANGE if the instance is outside
+ * of the tracking window, or -ENOENT if the type doesn't have a slot.
+ */
+static int unmanaged_bit(uint16_t type, uint16_t instance, bool allocate, int *slot)
+{
+	/* Instances below the base wrap */
+	if (((uint32_t)instance - UNMANAGED_BASE) >= MAX_UNMANAGED) {
+		return -ERANGE;
+	}
+
+	*slot = allocate ? get_type_slot(type) : find_type_slot(type);
+	if (*slot < 0) {
+		return -ENOENT;
+	}
+
+	return instance - UNMANAGED_BASE;
+}
+
+/* Returns true if the instance was already tracked and is known to exist */
+static bool unmanaged_test_and_set(int slot, int bit, uint16_t instance)
+{
+	ARG_UNUSED(instance);
+
+	if (atomic_test_and_set_bit(utl.type_slot[slot].unmanaged, bit)) {
+		/* Without the hook, the bit (and capacity) is reused and the engine create
+		 * reports an instance that still exists with -EEXIST.
+		 */
+		return unmanaged_exact(slot);
+	}
+
+#if CAPACITY
+	capacity_adjust(slot, 1);
+#endif
+	return false;
+}
+
+/* The delete hook untracks instances deleted by the server */
+static bool unmanaged_exact(int slot)
+{
+	return atomic_test_bit(utl.type_slot[slot].flags, TYPE_SLOT_DELETE_HOOK);
+}
+
+static void unmanaged_deleted(uint16_t type, uint16_t instance)
+{
+	int slot;
+	int bit;
+
+	bit = unmanaged_bit(type, instance, false, &slot);
+	if (bit >= 0 && atomic_test_and_clear_bit(utl.type_slot[slot].unmanaged, bit)) {
+#if CAPACITY
+		capacity_adjust(slot, -1);
+#endif
+	}
+}
+
+static int reserve_unmanaged_range(uint16_t type, uint16_t first_instance, uint16_t count)
+{
+	uint16_t i;
+	int slot;
+	int bit;
+
+	for (i = 0; i < count; i++) {
+		bit = unmanaged_bit(type, first_instance + i, true, &slot);
+		if (bit >= 0 && unmanaged_test_and_set(slot, bit, first_instance + i)) {
+			release_unmanaged_range(type, first_instance, i);
+			return -EEXIST;
+		}
+	}
+
+	return 0;
+}
+
+static void release_unmanaged_range(uint16_t type, uint16_t first_instance, uint16_t count)
+{
+	uint16_t i;
+
+	for (i = 0; i < count; i++) {
+		unmanaged_deleted(type, first_instance + i);
+	}
+}
+#endif /* TRACK_UNMANAGED */
+
+#if CAPACITY
+/* Every create is checked first, so the type has a slot to count its instances in */
+static int capacity_check(uint16_t type, uint16_t count)
+{
+	int headroom;
+
+	if (get_type_slot(type) < 0) {
+		return -ENOMEM;
+	}
+
+	headroom = lcz_lwm2m_util_get_headroom(type);
+	if (headroom >= 0 && headroom < count) {
+		LOG_DBG("Type %u at capacity", type);
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static void capacity_adjust(int slot, int delta)
+{
+	if (slot >= 0) {
+		atomic_add(&utl.type_slot[slot].live, delta);
+	}
+}
+
+/* The engine ran out of instances, so its pool holds the live instances plus any extra */
+static void capacity_learn(uint16_t type, int extra)
+{
+	int slot = find_type_slot(type);
+	int n;
+
+	if (slot >= 0) {
+		n = atomic_get(&utl.type_slot[slot].live) + extra;
+		if (n > 0) {
+			atomic_set(&utl.type_slot[slot].learned, n);
+			LOG_DBG("Learned capacity of %u: %d", type, n);
+		}
+	}
+}
+
+/* Instances may be shared with other users of the engine, so a learned capacity
+ * is forgotten after a delete and learned again on the next failure.
+ */
+static void capacity_freed(uint16_t type)
+{
+	int slot = find_type_slot(type);
+
+	if (slot >= 0) {
+		atomic_set(&utl.type_slot[slot].learned, 0);
+	}
+}
+#endif /* CAPACITY */
+
+#if DELETE_HOOK
+static int register_delete_hook(uint16_t type)
+{
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	bool own_delete_cb;
+	int slot;
+	int r;
+
+	slot = get_type_slot(type);
+	if (slot < 0) {
+		LOG_ERR("Delete hook for %u not registered: no type slot", type);
+		return slot;
+	}
+
+	if (atomic_test_bit(utl.type_slot[slot].flags, TYPE_SLOT_DELETE_HOOK)) {
+		return 0;
+	} else if (atomic_test_bit(utl.type_slot[slot].flags, TYPE_SLOT_DELETE_HOOK_CONFLICT)) {
+		return -EBUSY;
+	}
+
+	/* The engine holds one delete callback per object.  Don't replace the object's own. */
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	own_delete_cb = (agent != NULL && agent->own_delete_cb);
+	agents_put(agents);
+	if (own_delete_cb) {
+		LOG_DBG("Object %u has a delete callback; delete hook not registered", type);
+		atomic_set_bit(utl.type_slot[slot].flags, TYPE_SLOT_DELETE_HOOK_CONFLICT);
+		return -EBUSY;
+	}
+
+	r = lwm2m_engine_register_delete_callback(type, delete_trampolines[slot]);
+	if (r < 0) {
+		LOG_ERR("Unable to register delete callback for %u: %d", type, r);
+	} else {
+		atomic_set_bit(utl.type_slot[slot].flags, TYPE_SLOT_DELETE_HOOK);
+	}
+
+	return r;
 }
 
-int lcz_lwm2m_util_reg_post_write_cb(uint16_t type, uint16_t instance, uint16_t resource,
-				     lwm2m_engine_set_data_cb_t cb)
+/* Called by the engine when an object instance is deleted (by the server or locally).
+ * Instances deleted by the util have already been reset.
+ */
+static int obj_deleted_callback(int slot, uint16_t instance)
 {
-	char path[LWM2M_MAX_PATH_STR_LEN];
-
-	LCZ_SNPRINTK(path, "%u/%u/%u", type, instance, resource);
+	obj_deleted(utl.type_slot[slot].type, instance);
 
-	return lwm2m_engine_register_post_write_callback(path, cb);
+	return 0;
 }
 
-int lcz_lwm2m_util_create_obj_inst(uint16_t type, uint16_t instance)
+/* The engine may hold its own lock, so this doesn't block.  Bookkeeping that only uses
+ * atomics and spinlocks is done now; nodes are reset by the delete work.
+ */
+static void obj_deleted(uint16_t type, uint16_t instance)
 {
-#ifdef CONFIG_LCZ_LWM2M_UTIL_MANAGE_OBJ_INST
-	if (instance < CONFIG_LCZ_LWM2M_GATEWAY_OBJ_LEGACY_INST_OFFSET) {
-		return -EINVAL;
-	} else
+	struct delete_queue *q = &utl.deleted;
+	struct deleted_inst deleted = { .type = type, .instance = instance, .idx = -1 };
+	k_spinlock_key_t key;
+	bool queued = false;
+#if MANAGE_OBJS
+	int idx;
+	int i;
+#endif
+
+	LOG_DBG("Deleted %u/%u", type, instance);
+
+#if POST_WRITE_DISPATCH
+	lcz_lwm2m_util_unreg_post_write_handlers(type, instance);
+#endif
+
+#if TRACK_UNMANAGED
+	unmanaged_deleted(type, instance);
+#endif
+
+#if CAPACITY
+	/* Instances created by the server also free capacity */
+	capacity_freed(type);
+#endif
+
+#if MANAGE_OBJS
+	/* The node is only reset when the instance isn't indexed again before the work runs */
+	if (index_find(type, instance, &idx, &i)) {
+		index_remove(type, instance);
+		deleted.idx = idx;
+		deleted.node = i;
+	}
 #endif
-	{
-		/* Index not used when unmanaged */
-		return create_obj_inst(-1, type, instance);
+
+	key = k_spin_lock(&q->lock);
+	if (q->count < DELETE_QUEUE_SIZE) {
+		q->inst[(q->head + q->count) % DELETE_QUEUE_SIZE] = deleted;
+		q->count += 1;
+		queued = true;
+	}
+	k_spin_unlock(&q->lock, key);
+
+	if (queued) {
+		k_work_submit(&q->work);
+	} else {
+		/* A managed node is still reset when a set call fails */
+		LOG_WRN("Delete queue full, %u/%u not reset", type, instance);
 	}
 }
 
-int lcz_lwm2m_util_delete_obj_instance(uint16_t type, uint16_t instance)
+static bool delete_queue_pop(struct deleted_inst *deleted)
 {
-	char path[LWM2M_MAX_PATH_STR_LEN];
-
-	LCZ_SNPRINTK(path, "%u/%u", type, instance);
+	struct delete_queue *q = &utl.deleted;
+	k_spinlock_key_t key;
+	bool found = false;
+
+	key = k_spin_lock(&q->lock);
+	if (q->count > 0) {
+		*deleted = q->inst[q->head];
+		q->head = (q->head + 1) % DELETE_QUEUE_SIZE;
+		q->count -= 1;
+		found = true;
+	}
+	k_spin_unlock(&q->lock, key);
 
-	return lwm2m_engine_delete_obj_inst(path);
+	return found;
 }
 
-/**************************************************************************************************/
-/* Local Function Definitions                                                                     */
-/**************************************************************************************************/
-static int create_obj_inst(int idx, uint16_t type, uint16_t instance)
+static void delete_work_handler(struct k_work *work)
 {
-	char path[LWM2M_MAX_PATH_STR_LEN];
-	int r;
+	struct deleted_inst deleted;
+#if MANAGE_OBJS
+	struct node *node;
+	bool managed;
+	int idx;
+	int i;
+#endif
 
-	do {
-		LCZ_SNPRINTK(path, "%u/%u", type, instance);
-		r = lwm2m_engine_create_obj_inst(path);
-		if (r < 0) {
-			break;
-		}
+	ARG_UNUSED(work);
 
-		r = creation_callback(idx, type, instance);
-		if (r < 0) {
-			break;
+	while (delete_queue_pop(&deleted)) {
+#if LAZY_READ
+		lazy_cache_invalidate(deleted.type, deleted.instance);
+#endif
+
+#if MANAGE_OBJS
+		if (deleted.idx < 0) {
+			continue;
 		}
 
-#if defined(CONFIG_LCZ_LWM2M_UTIL_FWK_BROADCAST_ON_CREATE)
-		FRAMEWORK_MSG_CREATE_AND_BROADCAST(FWK_ID_RESERVED, FMC_LWM2M_OBJ_CREATED);
+		managed = false;
+		shard_lock(deleted.idx);
+		node = &utl.node_list[deleted.idx].node[deleted.node];
+		/* The node may have been reset or the instance created again */
+		if (node->type == deleted.type && node->instance == deleted.instance &&
+		    node->create_state == CREATE_OK &&
+		    !index_find(deleted.type, deleted.instance, &idx, &i)) {
+			managed = true;
+			if (CONFIG_LCZ_LWM2M_UTIL_RECREATE_HOLDOFF_SECONDS > 0) {
+#if USER_DATA
+				free_user_data(node);
 #endif
+				node->create_state = CREATE_HOLDOFF;
+				node->holdoff_until =
+					k_uptime_get_32() +
+					(CONFIG_LCZ_LWM2M_UTIL_RECREATE_HOLDOFF_SECONDS *
+					 MSEC_PER_SEC);
+			} else {
+				reset_node(node);
+			}
+		}
+		shard_unlock(deleted.idx);
 
-	} while (0);
-
-	return r;
+		/* The server freed an instance, so a previously failed create may now succeed */
+		if (managed) {
+			allow_create_on_delete(deleted.type);
+		}
+#endif
+	}
 }
+#endif /* DELETE_HOOK */
 
-static int creation_callback(int idx, uint16_t type, uint16_t instance)
+#if MANAGE_OBJS
+static inline void shard_lock(int idx)
 {
-	sys_snode_t *node;
-	struct lwm2m_obj_agent *agent;
-
-	/* Find the custom creation function for the object type */
-	SYS_SLIST_FOR_EACH_NODE (&utl.obj_agents, node) {
-		agent = CONTAINER_OF(node, struct lwm2m_obj_agent, node);
-		if (agent->type == type) {
-			if (agent->create != NULL) {
-				return agent->create(idx, type, instance, agent->context);
-			}
-		}
-	}
+	k_mutex_lock(&utl.shard_mutex[SHARD(idx)], K_FOREVER);
+}
 
-	return 0;
+static inline void shard_unlock(int idx)
+{
+	k_mutex_unlock(&utl.shard_mutex[SHARD(idx)]);
 }
 
-#if MANAGE_OBJS
 static struct node *find_node(struct node_list *node_list, uint16_t type, uint16_t instance)
 {
 	struct node *node = NULL;
@@ -424,11 +3402,17 @@ static struct node *find_unused_node(struct node_list *node_list)
 	return node;
 }
 
-/* reset node assumes mutex locked */
+/* reset node assumes shard is locked */
 static void reset_node(struct node *node)
 {
 	if (node) {
 		LOG_DBG("Reset node type: %u instance %u", node->type, node->instance);
+		if (node->create_state == CREATE_OK) {
+			index_remove(node->type, node->instance);
+		}
+#if USER_DATA
+		free_user_data(node);
+#endif
 		node->create_state = CREATE_ALLOW;
 		node->type = 0;
 		node->instance = 0;
@@ -437,7 +3421,337 @@ static void reset_node(struct node *node)
 	}
 }
 
-/* If an object has been removed, then a previously failed create may now succeed. */
+#if USER_DATA
+static void free_user_data(struct node *node)
+{
+	if (node->user_data != NULL) {
+		k_heap_free(&user_data_heap, node->user_data);
+		node->user_data = NULL;
+	}
+}
+#endif
+
+static inline uint32_t index_hash(uint16_t type, uint16_t instance)
+{
+	return ((((uint32_t)type << 16) | instance) * 2654435761U) % INDEX_SIZE;
+}
+
+/* Returns position of key or the empty position where it can be inserted (assumes index locked) */
+static uint32_t index_probe(uint16_t type, uint16_t instance)
+{
+	uint32_t i = index_hash(type, instance);
+
+	while (utl.index[i].idx != INDEX_EMPTY &&
+	       (utl.index[i].type != type || utl.index[i].instance != instance)) {
+		i = (i + 1) % INDEX_SIZE;
+	}
+
+	return i;
+}
+
+/* Returns -EEXIST if the instance is already indexed (the entry isn't replaced) */
+static int index_insert(uint16_t type, uint16_t instance, int idx, int slot)
+{
+	k_spinlock_key_t key;
+	uint32_t i;
+	int r = 0;
+
+	key = k_spin_lock(&utl.index_lock);
+	i = index_probe(type, instance);
+	if (utl.index[i].idx == INDEX_EMPTY) {
+		utl.index[i].type = type;
+		utl.index[i].instance = instance;
+		utl.index[i].idx = idx;
+		utl.index[i].slot = slot;
+	} else {
+		r = -EEXIST;
+	}
+	k_spin_unlock(&utl.index_lock, key);
+
+#if CAPACITY
+	/* The index holds every managed instance, so it also maintains the live count.
+	 * The slot was assigned by the capacity check.
+	 */
+	if (r == 0) {
+		managed_adjust(find_type_slot(type), 1);
+	}
+#endif
+
+	return r;
+}
+
+static void index_remove(uint16_t type, uint16_t instance)
+{
+	k_spinlock_key_t key;
+	bool removed = false;
+	uint32_t i;
+	uint32_t j;
+	uint32_t h;
+
+	key = k_spin_lock(&utl.index_lock);
+	i = index_probe(type, instance);
+	if (utl.index[i].idx != INDEX_EMPTY) {
+		removed = true;
+		/* Shift back entries that were displaced past the removed one */
+		j = i;
+		while (true) {
+			j = (j + 1) % INDEX_SIZE;
+			if (utl.index[j].idx == INDEX_EMPTY) {
+				break;
+			}
+
+			h = index_hash(utl.index[j].type, utl.index[j].instance);
+			if ((i <= j) ? ((i < h) && (h <= j)) : ((i < h) || (h <= j))) {
+				continue;
+			}
+
+			utl.index[i] = utl.index[j];
+			i = j;
+		}
+		utl.index[i].idx = INDEX_EMPTY;
+	}
+	k_spin_unlock(&utl.index_lock, key);
+
+#if CAPACITY
+	if (removed) {
+		managed_adjust(find_type_slot(type), -1);
+	}
+#else
+	ARG_UNUSED(removed);
+#endif
+}
+
+static bool index_find(uint16_t type, uint16_t instance, int *idx, int *slot)
+{
+	k_spinlock_key_t key;
+	bool found = false;
+	uint32_t i;
+
+	key = k_spin_lock(&utl.index_lock);
+	i = index_probe(type, instance);
+	if (utl.index[i].idx != INDEX_EMPTY) {
+		*idx = utl.index[i].idx;
+		*slot = utl.index[i].slot;
+		found = true;
+	}
+	k_spin_unlock(&utl.index_lock, key);
+
+	return found;
+}
+
+#if CAPACITY
+static void managed_adjust(int slot, int delta)
+{
+	capacity_adjust(slot, delta);
+#if QUOTA
+	if (slot >= 0) {
+		atomic_add(&utl.type_slot[slot].managed, delta);
+	}
+	atomic_add(&utl.managed, delta);
+#endif
+}
+#endif
+
+#if QUOTA
+/* Quotas are checked before the budget so that a type can't evict to exceed its own quota */
+static int quota_check(uint16_t type)
+{
+	struct agent_table *agents;
+	struct lwm2m_obj_agent *agent;
+	uint16_t quota = 0;
+	uint8_t priority = 0;
+	uint16_t victim;
+	atomic_val_t prev;
+	int slot;
+
+	agents = agents_get();
+	agent = find_agent(agents, type);
+	if (agent != NULL) {
+		quota = agent->quota;
+		priority = agent->priority;
+	}
+	agents_put(agents);
+
+	/* Unmanaged instances don't count against the quota of a type */
+	slot = find_type_slot(type);
+	if (quota > 0 && slot >= 0 && atomic_get(&utl.type_slot[slot].managed) >= quota) {
+		LOG_DBG("Quota of %u reached", type);
+		return -EDQUOT;
+	}
+
+	if (INSTANCE_BUDGET == 0 || atomic_get(&utl.managed) < INSTANCE_BUDGET) {
+		return 0;
+	}
+
+	if (!find_eviction_type(priority, &victim)) {
+		LOG_DBG("Budget reached for priority %u", priority);
+		return -EDQUOT;
+	}
+
+	/* Instances can't be deleted while a shard is locked, so the eviction is deferred.
+	 * The caller retries after the lower priority instance is deleted.
+	 */
+	do {
+		prev = atomic_get(&utl.evict_priority);
+	} while (prev < priority && !atomic_cas(&utl.evict_priority, prev, priority));
+	k_work_submit(&utl.evict_work);
+
+	return -EAGAIN;
+}
+
+/* Types without an agent have the lowest priority */
+static uint8_t type_priority(const struct agent_table *agents, uint16_t type)
+{
+	struct lwm2m_obj_agent *agent = find_agent(agents, type);
+
+	return (agent != NULL) ? agent->priority : 0;
+}
+
+/* Find the least important type with managed instances that is below priority */
+static bool find_eviction_type(uint8_t priority, uint16_t *type)
+{
+	struct agent_table *agents;
+	int n = (int)atomic_get(&utl.num_types);
+	bool found = false;
+	uint8_t lowest = priority;
+	uint8_t p;
+	int i;
+
+	agents = agents_get();
+	for (i = 0; i < n; i++) {
+		if (atomic_get(&utl.type_slot[i].managed) <= 0) {
+			continue;
+		}
+
+		p = type_priority(agents, utl.type_slot[i].type);
+		if (p < lowest) {
+			lowest = p;
+			*type = utl.type_slot[i].type;
+			found = true;
+		}
+	}
+	agents_put(agents);
+
+	return found;
+}
+
+/* An evicted node is left in the failed state, so it isn't created again until an
+ * instance of the same type is deleted (same as a create that failed).
+ */
+static bool evict_one(uint16_t type)
+{
+	char path[LWM2M_MAX_PATH_STR_LEN];
+	struct node *node;
+	bool found = false;
+	uint16_t instance;
+	int len;
+	int i;
+	int j;
+
+	for (j = 0; j < MAX_INSTANCES && !found; j++) {
+		shard_lock(j);
+		for (i = 0; i < MAX_NODES; i++) {
+			node = &utl.node_list[j].node[i];
+			if (node->type == type && node->create_state == CREATE_OK) {
+				instance = node->instance;
+				index_remove(type, instance);
+#if USER_DATA
+				free_user_data(node);
+#endif
+				node->create_state = CREATE_FAIL;
+				found = true;
+				break;
+			}
+		}
+		shard_unlock(j);
+	}
+
+	if (found) {
+		LOG_DBG("Evicting %u/%u", type, instance);
+		len = snprintk(path, sizeof(path), "%u/", type);
+		delete_obj_inst_with_prefix(path, sizeof(path), len, type, instance);
+	}
+
+	return found;
+}
+
+static void evict_work_handler(struct k_work *work)
+{
+	uint8_t priority = (uint8_t)atomic_set(&utl.evict_priority, 0);
+	uint16_t type;
+
+	ARG_UNUSED(work);
+
+	while (atomic_get(&utl.managed) >= INSTANCE_BUDGET &&
+	       find_eviction_type(priority, &type)) {
+		if (!evict_one(type)) {
+			break;
+		}
+	}
+}
+#endif /* QUOTA */
+
+#if ADMISSION
+/* Token bucket that limits the rate of creates.  The API is synchronous, so refused
+ * sensors aren't queued.  Instead, tokens are held for the most important priority
+ * that was refused until it retries or the hold expires.
+ */
+static int admission_check(uint16_t type)
+{
+	struct admission *adm = &utl.admission;
+	k_spinlock_key_t key;
+	uint8_t priority = 0;
+	uint32_t now;
+	uint64_t tokens;
+	int r = 0;
+#if QUOTA
+	struct agent_table *agents;
+
+	agents = agents_get();
+	priority = type_priority(agents, type);
+	agents_put(agents);
+#else
+	ARG_UNUSED(type);
+#endif
+
+	key = k_spin_lock(&adm->lock);
+	now = k_uptime_get_32();
+	tokens = adm->tokens + ((uint64_t)(now - adm->last_refill) * ADMISSION_RATE);
+	adm->tokens = MIN(tokens, ADMISSION_MAX_TOKENS);
+	adm->last_refill = now;
+
+	if (adm->held && (int32_t)(now - adm->held_until) >= 0) {
+		adm->held = false;
+	}
+
+	if (adm->held && priority < adm->held_priority) {
+		r = -EAGAIN;
+	} else if (adm->tokens < TOKEN) {
+		r = -EAGAIN;
+		if (!adm->held || priority >= adm->held_priority) {
+			adm->held = true;
+			adm->held_priority = priority;
+			adm->held_until = now + CONFIG_LCZ_LWM2M_UTIL_ADMISSION_HOLD_MS;
+		}
+	} else {
+		adm->tokens -= TOKEN;
+		if (adm->held && priority == adm->held_priority) {
+			adm->held = false;
+		}
+	}
+	k_spin_unlock(&adm->lock, key);
+
+	if (r < 0) {
+		LOG_DBG("Create of %u deferred", type);
+	}
+
+	return r;
+}
+#endif /* ADMISSION */
+
+/* If an object has been removed, then a previously failed create may now succeed.
+ * Each shard is locked in turn, so the caller must not hold a shard lock.
+ */
 static void allow_create_on_delete(uint16_t type)
 {
 	int i;
@@ -446,6 +3760,7 @@ static void allow_create_on_delete(uint16_t type)
 	struct node *node;
 
 	for (j = 0; j < MAX_INSTANCES; j++) {
+		shard_lock(j);
 		for (i = 0; i < MAX_NODES; i++) {
 			node = &utl.node_list[j].node[i];
 			if (node->type == type && node->create_state == CREATE_FAIL) {
@@ -453,6 +3768,7 @@ static void allow_create_on_delete(uint16_t type)
 				count += 1;
 			}
 		}
+		shard_unlock(j);
 	}
 
 	LOG_DBG("reset %d nodes in the create fail state", count);
@@ -461,9 +3777,11 @@ static void allow_create_on_delete(uint16_t type)
 static void gateway_obj_deleted_callback(int idx, void *data_ptr)
 {
 	int base_instance;
-	int instance;
 	int i;
+	int overflow = 0;
+	struct detached_inst overflow_inst[MAX_NODES];
 	struct node_list *node_list = data_ptr;
+	struct detached_inst *detached;
 
 	base_instance = lcz_lwm2m_gw_obj_get_instance(idx);
 	if (base_instance < 0) {
@@ -482,33 +3800,131 @@ static void gateway_obj_deleted_callback(int idx, void *data_ptr)
 		return;
 	}
 
-	/* Delete any [sensor] objects for this device. */
-	k_mutex_lock(&utl.mutex, K_FOREVER);
+	/* Delete any [sensor] objects for this device.
+	 * The nodes are detached under the lock.  The engine deletes occur in the sweep
+	 * work item so that ingestion isn't stalled.  The index can't be managed again
+	 * until the sweep is complete.
+	 */
+	shard_lock(idx);
 	for (i = 0; i < MAX_NODES; i++) {
 		if (node_list->node[i].create_state == CREATE_OK) {
-			instance = node_list->node[i].instance;
-			lcz_lwm2m_util_delete_obj_instance(node_list->node[i].type, instance);
-			allow_create_on_delete(node_list->node[i].type);
+			/* If the previous sweep hasn't run, then the list may be full */
+			if (node_list->detached_count < MAX_NODES) {
+				detached = &node_list->detached[node_list->detached_count++];
+			} else {
+				detached = &overflow_inst[overflow++];
+			}
+			detached->type = node_list->node[i].type;
+			detached->instance = node_list->node[i].instance;
 		}
 		reset_node(&node_list->node[i]);
 	}
-	k_mutex_unlock(&utl.mutex);
+	atomic_set_bit(utl.sweep_pending, idx);
+	shard_unlock(idx);
 
+	/* Agents are informed before the index can be reused by the gateway object */
 	gw_obj_deleted_handler(idx);
+
+	if (overflow > 0) {
+		LOG_WRN("Sweep overflow for %d", idx);
+		delete_detached(overflow_inst, overflow);
+	}
+
+	k_work_schedule(&utl.sweep_work, K_NO_WAIT);
+}
+
+/* Each slice processes a limited number of instances (or amount of time) and then
+ * yields so that engine and Bluetooth threads have bounded latency during mass deletions.
+ */
+static void sweep_work_handler(struct k_work *work)
+{
+	struct detached_inst detached;
+	struct node_list *node_list;
+	uint32_t start = k_cycle_get_32();
+	int processed = 0;
+	bool found;
+	int idx;
+
+	ARG_UNUSED(work);
+
+	for (idx = 0; idx < MAX_INSTANCES; idx++) {
+		if (!atomic_test_bit(utl.sweep_pending, idx)) {
+			continue;
+		}
+
+		node_list = &utl.node_list[idx];
+		do {
+			if (sweep_budget_exhausted(start, processed)) {
+				k_work_schedule(&utl.sweep_work,
+						K_MSEC(CONFIG_LCZ_LWM2M_UTIL_SWEEP_INTERVAL_MS));
+				return;
+			}
+
+			shard_lock(idx);
+			found = (node_list->detached_count > 0);
+			if (found) {
+				detached = node_list->detached[--node_list->detached_count];
+			} else {
+				atomic_clear_bit(utl.sweep_pending, idx);
+			}
+			shard_unlock(idx);
+
+			if (found) {
+				delete_detached(&detached, 1);
+				processed += 1;
+			}
+		} while (found);
+	}
+}
+
+static bool sweep_budget_exhausted(uint32_t start, int processed)
+{
+	if (CONFIG_LCZ_LWM2M_UTIL_SWEEP_MAX_NODES > 0 &&
+	    processed >= CONFIG_LCZ_LWM2M_UTIL_SWEEP_MAX_NODES) {
+		return true;
+	}
+
+	if (CONFIG_LCZ_LWM2M_UTIL_SWEEP_MAX_US > 0 &&
+	    k_cyc_to_us_floor32(k_cycle_get_32() - start) >= CONFIG_LCZ_LWM2M_UTIL_SWEEP_MAX_US) {
+		return true;
+	}
+
+	return false;
+}
+
+/* The caller must not hold a shard lock */
+static void delete_detached(const struct detached_inst *detached, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		lcz_lwm2m_util_delete_obj_instance(detached[i].type, detached[i].instance);
+		/* Nodes of other devices may live in other shards */
+		allow_create_on_delete(detached[i].type);
+	}
 }
 
+/* Every agent is informed; the first error is returned */
 static int gw_obj_deleted_handler(int idx)
 {
-	sys_snode_t *node;
+	struct agent_table *agents;
 	struct lwm2m_obj_agent *agent;
+	size_t i;
+	int status;
+	int r = 0;
 
-	SYS_SLIST_FOR_EACH_NODE (&utl.obj_agents, node) {
-		agent = CONTAINER_OF(node, struct lwm2m_obj_agent, node);
+	agents = agents_get();
+	for (i = 0; i < agents->agent_count; i++) {
+		agent = agents->agent[i];
 		if (agent->gw_obj_deleted != NULL) {
-			return agent->gw_obj_deleted(idx, agent->context);
+			status = agent->gw_obj_deleted(idx, agent->context);
+			if (status < 0 && r == 0) {
+				r = status;
+			}
 		}
 	}
+	agents_put(agents);
 
-	return 0;
+	return r;
 }
 #endif
\ No newline at end of file